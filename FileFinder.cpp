@@ -1,12 +1,31 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
 #include <iostream>
+#include <memory>
 #include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 #include <dirent.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <linux/magic.h>
+#include <sys/ioctl.h>
+#include <poll.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/vfs.h>
 #include <sys/wait.h>
 #include <unistd.h>
 using namespace std;
@@ -15,6 +34,11 @@ const int FILENAME_LENGTH = 255; // Max filename length in Linux
 const int PATHNAME_LENGTH = 4096; // Max pathname length in Linux
 const int PIPE_CAPACITY = 4096; // Pipe capacity in old versions of Linux
 // PIPE_CAPACITY is length of interrupted statement after searching directories for files and text
+const int MAX_ARGUMENTS = 16; // Command name, search term and flags
+const long long READ_CHUNK = 1024 * 1024; // Files are read in chunks so progress and throttling work within big files
+const long long SCAN_RANGE_SIZE = 16 * 1024 * 1024; // Files of at least 4 ranges are scanned by several threads
+const char SOCKET_NAME[] = "findstuff.sock"; // Used by --daemon and --connect in a per-user directory when no path is given
+const int REQUEST_TIMEOUT = 5000; // Milliseconds daemon waits for a client's whole request
 
 // Class used to assign serial numbers to all processes, and to track what they're doing
 // Global variable is used so that *processList is accessible during signals, specifically for kill and quit commands
@@ -22,9 +46,53 @@ class Processes {
     public:
         struct ProcessData {
             int pid;
-            int searchFlag; // 0 is searching for files, 1 is searching for text within files
+            int searchFlag; // 0 is searching for files, 1 is searching for text within files, 2 is searching for files with similar names
             bool isRecursive;
         };
+        // Counters published by a running search for list and watch commands
+        // Search is only writer, so readers in other processes never need to take mtx
+        struct Progress {
+            static const long long RATE_INTERVAL_NS = 500000000;
+
+            atomic<unsigned long long> directoriesDone;
+            atomic<unsigned long long> directoriesQueued; // Found but not finished yet
+            atomic<unsigned long long> filesScanned;
+            atomic<unsigned long long> bytesScanned;
+            atomic<unsigned long long> filesPerSecond;
+            atomic<unsigned long long> bytesPerSecond;
+            atomic<long long> lastActivity; // steady_clock nanoseconds, shows when search is stuck
+            atomic<unsigned int> pathSequence; // Odd while currentPath is being written
+            char currentPath[PATHNAME_LENGTH];
+            atomic<long long> sampleTime; // Whichever thread moves this on computes rates
+            atomic<unsigned long long> sampleFiles; // Atomic as range threads of one file may update rates too
+            atomic<unsigned long long> sampleBytes;
+
+            void reset();
+            void queueDirectory() { directoriesQueued.fetch_add(1, memory_order_relaxed); }
+            void startDirectory(const char *path, int pathLength);
+            void finishDirectory();
+            void addFile();
+            void addBytes(unsigned long long bytes);
+            void updateRate();
+            void getCurrentPath(char path[PATHNAME_LENGTH]);
+        };
+        // Token buckets limiting how fast a search (or all of them) may read, adjustable with throttle command
+        // Each bucket is only the time its budget is next free (GCRA), so any thread or process draws from it with one CAS
+        struct Budget {
+            static const long long BURST_NS = 100000000; // Up to 0.1 s worth of budget can be spent at once
+
+            atomic<long long> bytesPerSecond; // 0 for no limit
+            atomic<long long> filesPerSecond; // 0 for no limit
+            atomic<int> maxThreads; // 0 for no limit
+            atomic<bool> idleIO;
+            atomic<long long> bytesReadyTime;
+            atomic<long long> filesReadyTime;
+
+            void reset();
+            void setRates(long long bytesRate, long long filesRate);
+            long long reserve(bool isBytes, long long amount); // Returns nanoseconds to wait before spending
+            long long getWait(bool isBytes);
+        };
         static const int MAX_PROCESSES = 10;
         
         void initialize();
@@ -36,6 +104,13 @@ class Processes {
         ProcessData getProcessData(const int serialNumber, char emptySearchTerm[], char emptyFileExtension[]); // empty strings >= 255 chars
         int getPID(int serialNumber);
         bool isProcessWriting(int serialNumber);
+        bool cancelProcess(int serialNumber);
+        atomic<bool> *getCancelFlag(int serialNumber);
+        Progress *getProgress(int serialNumber);
+        Budget *getBudget(int serialNumber); // NULL if search isn't running
+        Budget *getGlobalBudget() { return &globalBudget; }
+        bool tryAddWorker(int serialNumber);
+        void removeWorker(int serialNumber);
         void destroyChild();
         
     private:
@@ -48,27 +123,154 @@ class Processes {
             int searchFlag;
             bool isRecursive;
             bool isWriting;
+            atomic<bool> cancelled; // Polled by searchDirectories(), used by daemon where searches are threads
+            Progress progress;
+            Budget budget;
+            int workers; // Threads searching for this process, counted against global thread limit
         } processes[MAX_PROCESSES];
+        Budget globalBudget;
 } *processList = (Processes*)mmap(NULL, sizeof(Processes), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
 
-// Class used to store pointers to all DIR pointers in searchDirectories()
-// searchDirectories() is recurssive and killing a child process with open directories causes massive memory leak
-// Global variable directoryList is used to close all directories after receiving a kill signal from parent process
-class Directories {
+enum Entry_Type { ENTRY_DIR, ENTRY_REG, ENTRY_OTHER };
+
+// Class used by the daemon to keep directory listings warm between searches from different clients
+// A listing is reused while the directory's mtime is unchanged, which skips readdir() and the stat() of every entry
+// Global variable directoryCache is only set in daemon mode, since forked REPL searches can't share it
+class DirectoryCache {
+    public:
+        struct Entry {
+            string name;
+            Entry_Type type;
+            ino_t inode;
+            bool isLink; // type is that of symlink's target
+        };
+        typedef shared_ptr<const vector<Entry>> Listing;
+        static const size_t MAX_DIRECTORIES = 65536;
+
+        Listing getListing(const char *directory, struct stat *sb); // Also fills sb with directory's own stat()
+    private:
+        struct CachedListing {
+            struct timespec mtime;
+            Listing entries;
+        };
+        mutex mtx;
+        unordered_map<string, CachedListing> listings;
+} *directoryCache = NULL;
+
+// Class used as explicit stack of open directories for searchDirectories(), so deep trees don't grow the call stack
+// Frames come from one arena reserved up front, and the path is a single buffer extended and truncated in place per entry
+// Global variable directoryStack is used by REPL searches, to close all directories after receiving a kill signal from parent process
+class DirectoryStack {
+    public:
+        static const int MAX_DEPTH = PATHNAME_LENGTH / 2; // Every level adds at least "/x" to path
+
+        DirectoryStack();
+        ~DirectoryStack();
+        void setPath(const char *directory);
+        void setFollowLinks(bool follow) { followLinks = follow; }
+        bool push(); // Opens directory at current path
+        void pop();
+        bool nextEntry(const char **filename, Entry_Type *type); // Extends path with top directory's next entry
+        void endEntry(); // Truncates path back to top directory
+        bool isEmpty() { return depth == 0; }
+        int getDepth() { return depth; }
+        char *getPath() { return path; }
+        int getPathLength() { return pathLength; }
+        ino_t getEntryInode() { return entryInode; }
+        int getDirectoryLength() { return frames[depth - 1].pathLength; }
+        dev_t getDirectoryDevice() { return frames[depth - 1].device; }
+        ino_t getDirectoryInode() { return frames[depth - 1].inode; }
+        void closeAllDIR();
+    private:
+        struct Frame {
+            DIR *dir;
+            DirectoryCache::Listing listing; // Used instead of dir in daemon mode
+            size_t nextEntry;
+            int pathLength;
+            dev_t device;
+            ino_t inode; // 0 when directory couldn't be stat()ed
+        } *frames;
+        int depth;
+        char path[PATHNAME_LENGTH];
+        int pathLength;
+        ino_t entryInode;
+        bool followLinks; // Otherwise symlinks are reported as ENTRY_OTHER, so they're never walked or read
+} directoryStack;
+
+// Class used so one search walks every directory, and reads every hardlinked file, only once
+// (device, inode) pairs are kept in one open-addressed table that doubles when half full, which also stops symlink loops,
+// and directories on pseudo-filesystems like /proc, or on other filesystems than search root with -xdev, are turned away
+// Files with one link aren't kept, so a file reached through a symlink as well as directly is read through both
+class VisitedSet {
     public:
-        ~Directories(); 
-        void initialize() { root = NULL; }
-        void addDIR(DIR **dir); 
-        void removeDIR(DIR **dir); 
-        void closeAllDIRAndDestroy();
+        static const size_t INITIAL_CAPACITY = 1024;
+
+        VisitedSet(bool sameFilesystem);
+        ~VisitedSet() { delete[] slots; }
+        bool enterDirectory(dev_t device, ino_t inode, const char *path); // First directory entered is search root
+        bool getFileResult(dev_t device, ino_t inode, bool *found, vector<long long> *locations); // False if file wasn't read yet
+        void setFileResult(dev_t device, ino_t inode, bool found, const vector<long long> *locations);
     private:
-        struct node {
-            DIR **dir;
-            node *next;
-        } *root;
-} directoryList;
+        struct Slot {
+            dev_t device;
+            ino_t inode; // 0 for empty slot
+            int fileResult; // Index into fileResults, -1 for directories
+        } *slots;
+        struct FileResult {
+            bool found;
+            vector<long long> locations; // Only kept with -l
+        };
+        size_t capacity;
+        size_t used;
+        bool sameFilesystem;
+        vector<pair<dev_t, bool>> devices; // Whether search goes into each filesystem seen so far, root's comes first
+        vector<FileResult> fileResults;
+
+        Slot *findSlot(dev_t device, ino_t inode); // Slot holding pair, or empty slot where it would go
+        bool insert(dev_t device, ino_t inode, int fileResult);
+        bool isDeviceAllowed(dev_t device, const char *path);
+};
+
+// Class used by breadth-first searches (-b) to hold directories that are waiting to be walked
+// Paths are packed into fixed-size chunks, which are reused once every path in them has been taken out
+class DirectoryQueue {
+    public:
+        static const int CHUNK_SIZE = 64 * 1024; // Always fits a PATHNAME_LENGTH path and its header
 
-enum Command_Type { FIND, LIST, KILL, QUIT, INVALID };
+        DirectoryQueue() { head = tail = spare = NULL; }
+        ~DirectoryQueue();
+        void push(const char *path, int pathLength, int depth);
+        bool pop(const char **path, int *depth); // path stays valid until next pop
+    private:
+        struct Chunk {
+            Chunk *next;
+            int used;
+            int taken;
+            char data[CHUNK_SIZE];
+        } *head, *tail, *spare;
+};
+
+// State shared by every level of one search
+// Results are collected into message for the REPL's pipe, or written straight to streamFd by the daemon
+typedef struct {
+    char *message;
+    int *messageLength;
+    int streamFd; // -1 when not streaming
+    char *rootDirectory;
+    bool foundSomething;
+    int resultCount;
+    DirectoryStack *stack;
+    atomic<bool> *cancelled; // NULL when search can't be cancelled other than by signal
+    Processes::Progress *progress;
+    Processes::Budget *budget;
+    bool idleIO; // I/O priority currently applied to search thread
+    int serialNumber;
+    vector<long long> *locations; // Offsets of every match in current file, NULL unless -l
+    VisitedSet *visited; // Set by searchDirectories()
+    long long prepaidBytes; // Start of current file already charged to budget when it was prefetched
+} SearchContext;
+
+enum Command_Type { FIND, LIST, WATCH, KILL, THROTTLE, QUIT, INVALID };
 typedef struct {
     Command_Type commandType;
 
@@ -77,32 +279,137 @@ typedef struct {
     char searchText[FILENAME_LENGTH];
     char fileExtension[FILENAME_LENGTH]; 
     bool searchSubDir;
-
-    // Command_Type KILL
+    bool orderedReads; // Text search reads files in on-disk order, see ReadScheduler
+    bool showLocations; // Text search lists offset of every match
+    bool breadthFirst;
+    int maxResults; // 0 for no limit
+    int maxDepth; // 0 for no limit, 1 is only current directory
+    bool sameFilesystem; // -xdev
+    bool followLinks; // -L (default) or -P
+
+    // Command_Type WATCH
+    int interval;
+
+    // Command_Type FIND and THROTTLE, -1 leaves setting as it is
+    long long bytesPerSecond;
+    long long filesPerSecond;
+    int maxThreads;
+    int idleIO;
+
+    // Command_Type KILL and THROTTLE, -1 is all processes for THROTTLE
     int id;
 } Command;
 
-bool parseInput(char *userInput, int inputSize, char *parsedInput[]);
-Command parseCommand(char *arg[]);
+// Class used by fuzzy filename search (find ~name) to keep names closest to searchText from one walk
+// Names are compared by edit distance with Myers' bit-parallel algorithm, where one machine word covers whole pattern,
+// and names that can't beat worst result kept so far are rejected by length and character-set bitmask first
+class FuzzyMatcher {
+    public:
+        static const int MAX_PATTERN_LENGTH = 64;
+        static const int DEFAULT_RESULTS = 10;
+
+        FuzzyMatcher(const char *pattern, int maxResults);
+        void consider(const char *filename, const char *filePath);
+        void report(SearchContext &context);
+    private:
+        struct Match {
+            int distance;
+            string path;
+            bool operator<(const Match &other) const { return distance < other.distance || (distance == other.distance && path < other.path); }
+        };
+        unsigned long long peq[256]; // Bit i set where pattern[i] is that character
+        unsigned long long patternMask;
+        int patternLength;
+        int maxDistance;
+        size_t maxResults;
+        vector<Match> results; // Max-heap, so worst kept result is at front
+
+        int editDistance(const char *name, int nameLength, int limit);
+        static unsigned long long getCharacterMask(const char *str, int length);
+};
+
+// Class used by text searches with -i to read candidate files in on-disk order instead of readdir() order
+// Batches are sorted by first physical extent where FIEMAP is supported, otherwise by inode number,
+// and upcoming files are prefetched with posix_fadvise() while the current one is matched
+class ReadScheduler {
+    public:
+        static const int BATCH_SIZE = 64;
+        static const int PATH_POOL_SIZE = 64 * 1024;
+        static const int READAHEAD_FILES = 4;
+        static const long long READAHEAD_BYTES = READ_CHUNK; // Prefetched from start of each upcoming file
+
+        ReadScheduler();
+        ~ReadScheduler();
+        bool add(const char *filePath, int pathLength, ino_t inode); // Returns false when batch is full
+        void flush(const Command &command, SearchContext &context);
+    private:
+        struct Candidate {
+            int pathOffset;
+            int fd;
+            ino_t inode;
+            unsigned long long physical;
+            long long prefetched;
+        } candidates[BATCH_SIZE];
+        int count;
+        char *pathPool;
+        int poolUsed;
+
+        void prefetch(Candidate &candidate, const Command &command, SearchContext &context);
+};
+
+bool parseInput(char *userInput, int inputSize, char *parsedInput[], int outputFd);
+Command parseCommand(char *arg[], int outputFd);
 bool issueCommand(const Command &command, int *pipeSize, bool *stdinOverwritten);
 
 bool findCommand(const Command &command, int *pipeSize, bool *stdinOverwritten);
-void fillPrintMessage(const Command &command, char *message, int *stringLength, int serialNumber); 
-void searchDirectories(const Command &command, char *message, int *messageLength, char *directory, bool *foundSomething);
-
-void listCommand();
+void fillPrintMessage(const Command &command, SearchContext &context, int serialNumber); 
+void searchDirectories(const Command &command, SearchContext &context, char *directory);
+bool enterDirectory(SearchContext &context);
+bool isSearchCancelled(const SearchContext &context);
+bool isSearchFinished(const Command &command, const SearchContext &context);
+
+bool listCommand(int outputFd);
+void printProgress(int outputFd, Processes::Progress *progress);
+void watchCommand(int outputFd, int interval, bool *stdinOverwritten);
+void throttleCommand(int outputFd, const Command &command);
+void printBudget(int outputFd, Processes::Budget *budget);
+void setBudget(Processes::Budget *budget, const Command &command);
+void spendBudget(SearchContext &context, bool isBytes, long long amount);
+void applyIOPriority(SearchContext &context);
 void killCommand(int killSerialNumber, bool writeOutput);
 bool quitCommand();
 
-void fillFilePath(char *directory, char *filename, char *filePath);
-bool isDirectory(const char *directory);
-bool isRegFile(const char *filePath);
+const char *getDefaultSocketPath(char path[PATHNAME_LENGTH]);
+int runDaemon(const char *socketPath);
+void serveClient(int clientFd);
+void watchClient(int clientFd, int stopFd, atomic<bool> *cancelled);
+int runClient(const char *socketPath);
+int connectToDaemon(const char *socketPath);
+bool sendRequest(int socketFd, const char *command, int commandLength);
+void relayResponse(int socketFd, bool stopOnInput);
+
+void fillFilePath(const char *directory, const char *filename, char *filePath);
+Entry_Type getEntryType(const char *filePath, unsigned char dType, bool *isLink);
 bool hasCorrectExtension(const char *filename, const char *fileExtension);
-bool isTextInFile(const char *filePath, const char *searchText);
+int parsePositiveInt(const char *str);
+long long parseAmount(const char *str);
+int parseBudgetOption(char *arg[], int i, Command &command, int outputFd);
+bool isTextInFile(const char *filePath, const char *searchText, SearchContext &context);
+bool isTextInOpenFile(int fileFd, const char *searchText, SearchContext &context);
+bool isTextInSmallFile(int fileFd, long long size, const char *searchText, SearchContext &context);
+bool isTextInLargeFile(int fileFd, long long size, const char *searchText, SearchContext &context);
+bool findText(const char *buffer, long long length, const char *searchText, int textLength, long long offset, long long startLimit,
+              vector<long long> *locations);
+void reportTextMatch(const Command &command, SearchContext &context, const char *filePath);
+void reportOpenError(SearchContext &context, const char *filePath);
 bool isPreviousDir(char *filename) { return (strcmp(filename, "..") == 0); }
 bool isCurrentDir(char *filename) { return (strcmp(filename, ".") == 0); }
 void appendString(char *mainString, const char *stringToAppend, int *mainStringSize);
+void appendResult(SearchContext &context, const char *stringToAppend);
+bool writeAll(int fd, const char *buffer, int size);
 void fillTimeEllapsedString(float timeInSeconds, char str[13]);
+void fillByteString(unsigned long long bytes, char str[16]);
+long long getSteadyTime();
 void waitRunningProcesses(bool shouldHang); 
 
 const int PARENT_ID = getpid();
@@ -113,8 +420,25 @@ bool childIsWriting; // Global variable used during signal calls to indicate whe
 void childKill(int i);
 mutex mtx;
 
-int main() 
+int main(int argc, char *argv[]) 
 {
+    if (argc > 1)
+    {
+        char defaultPath[PATHNAME_LENGTH];
+        const char *socketPath = (argc > 2) ? argv[2] : getDefaultSocketPath(defaultPath);
+        if (socketPath == NULL)
+        {
+            printf("ERROR. Could not find a directory only this user can use for socket. Expected socket path after %s.\n", argv[1]);
+            return 1;
+        }
+        if (strcmp(argv[1], "--daemon") == 0)
+            return runDaemon(socketPath);
+        if (strcmp(argv[1], "--connect") == 0)
+            return runClient(socketPath);
+        printf("ERROR. Argument %s not recognized. Expected --daemon or --connect.\n", argv[1]);
+        return 1;
+    }
+
     pipe(fd);
     signal(SIGUSR1, stdinOverwrite);
     int save_stdin = dup(STDIN_FILENO);
@@ -123,7 +447,6 @@ int main()
     signal(SIGUSR2, childKill);
 
     processList->initialize();
-    directoryList.initialize();
 
     int *pipeSize = (int*)mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
     *pipeSize = 0;
@@ -148,12 +471,12 @@ int main()
         }
         else
         {
-            char *arg[4] = {NULL, NULL, NULL, NULL};
+            char *arg[MAX_ARGUMENTS] = {NULL};
             int inputLength = 1;
             for (; userInput[inputLength - 1] != '\n'; inputLength++);
-            if (parseInput(userInput, inputLength, arg))
+            if (parseInput(userInput, inputLength, arg, STDOUT_FILENO))
             {
-                Command command = parseCommand(arg);
+                Command command = parseCommand(arg, STDOUT_FILENO);
                 loop = issueCommand(command, pipeSize, stdinOverwritten);
             }
         }
@@ -171,7 +494,7 @@ int main()
     return 0;
 }
 
-bool parseInput(char *userInput, int inputSize, char *parsedInput[])
+bool parseInput(char *userInput, int inputSize, char *parsedInput[], int outputFd)
 {
     int currentArg = 0;
     int argStart = 0, argEnd = 0;
@@ -183,11 +506,11 @@ bool parseInput(char *userInput, int inputSize, char *parsedInput[])
             isInQuotes = false;
         else if ((!isInQuotes && userInput[i] == ' ') || userInput[i] == '\n')
         {
-            if (currentArg > 3)
+            if (currentArg >= MAX_ARGUMENTS)
             {
-                for (int i = 0; i < 4; i++)
+                for (int i = 0; i < MAX_ARGUMENTS; i++)
                     delete[] parsedInput[i];
-                printf("ERROR. Too many arguments.\nExpected no more than 4.\n");
+                dprintf(outputFd, "ERROR. Too many arguments.\nExpected no more than %d.\n", MAX_ARGUMENTS);
                 return false;
             }
             argStart = argEnd;
@@ -202,88 +525,182 @@ bool parseInput(char *userInput, int inputSize, char *parsedInput[])
     return true;
 }
 
-Command parseCommand(char *arg[])
+Command parseCommand(char *arg[], int outputFd)
 {
     Command command;
     if (strcmp(arg[0], "find") == 0) 
     {
         command.commandType = Command_Type::FIND;
-        bool dashSSet = false;
-        bool extSet = false;
-        if (arg[1][0] == '"' && arg[1][strlen(arg[1]) - 1] == '"')
-        {
-            command.searchFlag = 1;
-            arg[1][strlen(arg[1]) - 1] = 0;
-            strcpy(command.searchText, arg[1] + 1);
-            for (int i = 2; i < 4; i++)
+        command.searchSubDir = false;
+        command.orderedReads = false;
+        command.showLocations = false;
+        command.breadthFirst = false;
+        command.maxResults = 0;
+        command.maxDepth = 0;
+        command.sameFilesystem = false;
+        command.followLinks = true;
+        command.bytesPerSecond = -1;
+        command.filesPerSecond = -1;
+        command.maxThreads = -1;
+        command.idleIO = -1;
+        command.fileExtension[0] = 0;
+        if (arg[1] == NULL)
+        {
+            dprintf(outputFd, "ERROR. Expected filename or \"text\" for find command.\n");
+            command.commandType = Command_Type::INVALID;
+        }
+        else if (strlen(arg[1]) >= FILENAME_LENGTH)
+        {
+            dprintf(outputFd, "ERROR. Search term is too long.\nExpected no more than %d characters.\n", FILENAME_LENGTH - 1);
+            command.commandType = Command_Type::INVALID;
+        }
+        else
+        {
+            if (arg[1][0] == '"' && arg[1][strlen(arg[1]) - 1] == '"')
+            {
+                command.searchFlag = 1;
+                arg[1][strlen(arg[1]) - 1] = 0;
+                strcpy(command.searchText, arg[1] + 1);
+            }
+            else if (arg[1][0] == '~')
+            {
+                command.searchFlag = 2;
+                strcpy(command.searchText, arg[1] + 1);
+                int patternLength = strlen(command.searchText);
+                if (patternLength == 0 || patternLength > FuzzyMatcher::MAX_PATTERN_LENGTH)
+                {
+                    dprintf(outputFd, "ERROR. Expected name of 1-%d characters after ~ for fuzzy find command.\n", FuzzyMatcher::MAX_PATTERN_LENGTH);
+                    command.commandType = Command_Type::INVALID;
+                }
+            }
+            else
+            {
+                command.searchFlag = 0;
+                strcpy(command.searchText, arg[1]);
+            }
+            for (int i = 2; command.commandType == Command_Type::FIND && i < MAX_ARGUMENTS && arg[i] != NULL; i++)
             {
-                if (arg[i] != NULL)
+                int budgetArgs = parseBudgetOption(arg, i, command, outputFd);
+                if (budgetArgs == -1)
                 {
-                    if (strcmp(arg[i], "-s") == 0)
+                    command.commandType = Command_Type::INVALID;
+                    break;
+                }
+                if (budgetArgs > 0)
+                    i += budgetArgs - 1;
+                else if (strcmp(arg[i], "-s") == 0)
+                    command.searchSubDir = true;
+                else if (strcmp(arg[i], "-b") == 0)
+                    command.breadthFirst = true;
+                else if (strcmp(arg[i], "--first") == 0)
+                    command.maxResults = 1;
+                else if (strcmp(arg[i], "-xdev") == 0)
+                    command.sameFilesystem = true;
+                else if (strcmp(arg[i], "-L") == 0 || strcmp(arg[i], "-P") == 0)
+                    command.followLinks = (arg[i][1] == 'L');
+                else if (strcmp(arg[i], "-n") == 0 || strcmp(arg[i], "-d") == 0)
+                {
+                    int value = (i + 1 < MAX_ARGUMENTS && arg[i + 1] != NULL) ? parsePositiveInt(arg[i + 1]) : -1;
+                    if (value == -1)
                     {
-                        command.searchSubDir = true;
-                        dashSSet = true;
+                        dprintf(outputFd, "ERROR. Expected positive integer after %s.\n", arg[i]);
+                        command.commandType = Command_Type::INVALID;
+                        break;
                     }
-                    else if (arg[i][0] == '-' && arg[i][1] == 'f' && arg[i][2] == ':')
+                    if (arg[i][1] == 'n')
+                        command.maxResults = value;
+                    else
                     {
-                        strcpy(command.fileExtension, arg[i] + 3);
-                        extSet = true;
+                        command.maxDepth = value;
+                        command.searchSubDir = true; // Depth limit only makes sense for recursive search
                     }
-                    else
+                    i++;
+                }
+                else if (command.searchFlag == 1 && strcmp(arg[i], "-i") == 0)
+                    command.orderedReads = true;
+                else if (command.searchFlag == 1 && strcmp(arg[i], "-l") == 0)
+                    command.showLocations = true;
+                else if (command.searchFlag == 1 && arg[i][0] == '-' && arg[i][1] == 'f' && arg[i][2] == ':')
+                {
+                    if (strlen(arg[i] + 3) >= FILENAME_LENGTH)
                     {
-                        printf("ERROR. Argument %s not recognized. Expected -s or -f: for text find command.\n", arg[i]);
+                        dprintf(outputFd, "ERROR. Extension is too long.\nExpected no more than %d characters.\n", FILENAME_LENGTH - 1);
                         command.commandType = Command_Type::INVALID;
                         break;
                     }
-                }
-            }
-            if (!extSet)
-                command.fileExtension[0] = 0;
-        }
-        else
-        {
-            command.searchFlag = 0;
-            command.fileExtension[0] = 0;
-            strcpy(command.searchText, arg[1]);
-            if (arg[2] != NULL)
-            {
-                if (strcmp(arg[2], "-s") == 0)
-                {
-                    command.searchSubDir = true;
-                    dashSSet = true;
+                    strcpy(command.fileExtension, arg[i] + 3);
                 }
                 else
                 {
-                    printf("ERROR. Argument %s not recognized. Expected -s for file find command.\n", arg[2]);
+                    if (command.searchFlag == 1)
+                        dprintf(outputFd, "ERROR. Argument %s not recognized. Expected -s, -b, -n, -d, --first, -xdev, -L, -P, -i, -l, -f: or a throttle option for text find command.\n", arg[i]);
+                    else
+                        dprintf(outputFd, "ERROR. Argument %s not recognized. Expected -s, -b, -n, -d, --first, -xdev, -L, -P or a throttle option for file find command.\n", arg[i]);
                     command.commandType = Command_Type::INVALID;
+                    break;
                 }
             }
         }
-        if (!dashSSet)
-            command.searchSubDir = false;
     }
     else if (strcmp(arg[0], "list") == 0) 
         command.commandType = Command_Type::LIST;
+    else if (strcmp(arg[0], "watch") == 0)
+    {
+        command.commandType = Command_Type::WATCH;
+        command.interval = (arg[1] == NULL) ? 1 : parsePositiveInt(arg[1]);
+        if (command.interval == -1)
+        {
+            dprintf(outputFd, "ERROR. Argument %s not recognized. Expected number of seconds between refreshes for watch command.\n", arg[1]);
+            command.commandType = Command_Type::INVALID;
+        }
+    }
     else if (strcmp(arg[0], "kill") == 0) 
     {
         command.commandType = Command_Type::KILL;
         if (arg[1] == NULL || strlen(arg[1]) > 1 || arg[1][0] < 48 || arg[1][0] > 57) // 48 = '0' and 57 = '9'
         {
-            printf("ERROR. Argument %s not recognized. Expected integer value between 0-9 for kill command.\n", arg[1]);
+            dprintf(outputFd, "ERROR. Argument %s not recognized. Expected integer value between 0-9 for kill command.\n", arg[1]);
             command.commandType = Command_Type::INVALID;
         }
         else
             command.id = arg[1][0] - 48;
     }
+    else if (strcmp(arg[0], "throttle") == 0)
+    {
+        command.commandType = Command_Type::THROTTLE;
+        command.bytesPerSecond = -1;
+        command.filesPerSecond = -1;
+        command.maxThreads = -1;
+        command.idleIO = -1;
+        if (arg[1] != NULL && strcmp(arg[1], "all") == 0)
+            command.id = -1;
+        else if (arg[1] == NULL || strlen(arg[1]) > 1 || arg[1][0] < 48 || arg[1][0] > 57)
+        {
+            dprintf(outputFd, "ERROR. Argument %s not recognized. Expected integer value between 0-9 or all for throttle command.\n", arg[1]);
+            command.commandType = Command_Type::INVALID;
+        }
+        else
+            command.id = arg[1][0] - 48;
+        for (int i = 2; command.commandType == Command_Type::THROTTLE && i < MAX_ARGUMENTS && arg[i] != NULL; i++)
+        {
+            int budgetArgs = parseBudgetOption(arg, i, command, outputFd);
+            if (budgetArgs == 0)
+                dprintf(outputFd, "ERROR. Argument %s not recognized. Expected --bps, --fps, -j, --idle or --normal for throttle command.\n", arg[i]);
+            if (budgetArgs <= 0)
+                command.commandType = Command_Type::INVALID;
+            else
+                i += budgetArgs - 1;
+        }
+    }
     else if (strcmp(arg[0], "quit") == 0 || strcmp(arg[0], "q") == 0) 
         command.commandType = Command_Type::QUIT;
     else    
     {
         command.commandType = Command_Type::INVALID;
-        printf("ERROR. Argument %s not recognized.\n", arg[0]);
+        dprintf(outputFd, "ERROR. Argument %s not recognized.\n", arg[0]);
     }
 
-    for (int i = 0; i < 4; i++)
+    for (int i = 0; i < MAX_ARGUMENTS; i++)
     {
         delete[] arg[i];
         arg[i] = NULL;
@@ -300,9 +717,13 @@ bool issueCommand(const Command &command, int *pipeSize, bool *stdinOverwritten)
             return findCommand(command, pipeSize, stdinOverwritten); // Child returns false and exits loop to close program
     }
     else if (command.commandType == Command_Type::LIST)
-        listCommand();
+        listCommand(STDOUT_FILENO);
+    else if (command.commandType == Command_Type::WATCH)
+        watchCommand(STDOUT_FILENO, command.interval, stdinOverwritten);
     else if (command.commandType == Command_Type::KILL)
         killCommand(command.id, true);
+    else if (command.commandType == Command_Type::THROTTLE)
+        throttleCommand(STDOUT_FILENO, command);
     else if (command.commandType == Command_Type::QUIT)
         return quitCommand(); // Returns false to exit loop
     return true;
@@ -316,7 +737,14 @@ bool findCommand(const Command &command, int *pipeSize, bool *stdinOverwritten)
     int *stringLength = &len;
     int serialNumber = processList->addProcess(command.searchText, command.fileExtension, command.searchSubDir, command.searchFlag);
 
-    fillPrintMessage(command, printMessage, stringLength, serialNumber);
+    char directory[PATHNAME_LENGTH];
+    getcwd(directory, PATHNAME_LENGTH);
+    Processes::Progress *progress = (serialNumber == -1) ? NULL : processList->getProgress(serialNumber);
+    Processes::Budget *budget = (serialNumber == -1) ? NULL : processList->getBudget(serialNumber);
+    vector<long long> locations;
+    SearchContext context = { printMessage, stringLength, -1, directory, false, 0, &directoryStack, NULL, progress, budget, false,
+                              serialNumber, command.showLocations ? &locations : NULL, NULL, 0 };
+    fillPrintMessage(command, context, serialNumber);
     
     while (*stdinOverwritten); // Wait until pipe contents have been read before writing more
     processList->startWriting(serialNumber);
@@ -335,121 +763,295 @@ bool findCommand(const Command &command, int *pipeSize, bool *stdinOverwritten)
     return false;
 }
 
-void fillPrintMessage(const Command &command, char *message, int *stringLength, int serialNumber)
+void fillPrintMessage(const Command &command, SearchContext &context, int serialNumber)
 {
-    appendString(message, "Interrupt: Process ", stringLength);
+    appendResult(context, "Interrupt: Process ");
     if (serialNumber == -1)
     {
-        appendString(message, "cannot be completed.\nCannot search for ", stringLength);
+        appendResult(context, "cannot be completed.\nCannot search for ");
         if (command.searchFlag == 0)
-            appendString(message, "file ", stringLength);
+            appendResult(context, "file ");
+        else if (command.searchFlag == 2)
+            appendResult(context, "file like ");
         else
-            appendString(message, "instance of \"", stringLength);
-        appendString(message, command.searchText, stringLength);
+            appendResult(context, "instance of \"");
+        appendResult(context, command.searchText);
         if (command.searchFlag == 1)
-            appendString(message, "\"\n", stringLength);
+            appendResult(context, "\"\n");
         else
-            appendString(message, "\n", stringLength);
-        appendString(message, "Maximum 10 processes at a time.\nPlease try again later.\n", stringLength);
+            appendResult(context, "\n");
+        appendResult(context, "Maximum 10 processes at a time.\nPlease try again later.\n");
         return;
     }
 
     string serialString = to_string(serialNumber);
     char const *serialCharArr = serialString.c_str();
-    appendString(message, serialCharArr, stringLength);
-    appendString(message, " ", stringLength);
-    
-    bool foundSomething = false;
-    char directory[PATHNAME_LENGTH];
-    getcwd(directory, PATHNAME_LENGTH);
-
-    clock_t start = clock();
-    searchDirectories(command, message, stringLength, directory, &foundSomething);
-    clock_t end = clock();
-    double timeElapsed = (double)(end - start) / CLOCKS_PER_SEC;
-
-    if (!foundSomething)
+    appendResult(context, serialCharArr);
+    appendResult(context, " ");
+
+    // Wall clock rather than clock(), as daemon searches share one process's CPU time
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    setBudget(context.budget, command);
+    while (!processList->tryAddWorker(serialNumber) && !isSearchCancelled(context)) // Waits out global thread limit
+        usleep(10000);
+    searchDirectories(command, context, context.rootDirectory);
+    processList->removeWorker(serialNumber);
+    chrono::steady_clock::time_point end = chrono::steady_clock::now();
+    double timeElapsed = chrono::duration<double>(end - start).count();
+
+    if (isSearchCancelled(context))
+    {
+        appendResult(context, "Search was killed.\n");
+        return;
+    }
+    if (command.searchFlag != 2 && command.maxResults != 0 && context.resultCount >= command.maxResults)
+    {
+        appendResult(context, "Stopped after ");
+        appendResult(context, to_string(context.resultCount).c_str());
+        appendResult(context, context.resultCount == 1 ? " result.\n" : " results.\n");
+    }
+    if (!context.foundSomething)
     {
 
-        appendString(message, "completed.\nUnable to find ", stringLength);
+        appendResult(context, "completed.\nUnable to find ");
         if (command.searchFlag == 0)
-            appendString(message, "file ", stringLength);
+            appendResult(context, "file ");
+        else if (command.searchFlag == 2)
+            appendResult(context, "file like ");
         else
-            appendString(message, "instance of \"", stringLength);
-        appendString(message, command.searchText, stringLength);
+            appendResult(context, "instance of \"");
+        appendResult(context, command.searchText);
         if (command.searchFlag == 1)
-            appendString(message, "\".\n", stringLength);
+            appendResult(context, "\".\n");
         else
-            appendString(message, ".\n", stringLength);
+            appendResult(context, ".\n");
     }
     char elapsedString[13];
     fillTimeEllapsedString(timeElapsed, elapsedString);
-    appendString(message, "Time elapsed: ", stringLength);
-    appendString(message, elapsedString, stringLength);
-    appendString(message, ".\n", stringLength);
+    appendResult(context, "Time elapsed: ");
+    appendResult(context, elapsedString);
+    appendResult(context, ".\n");
 }
 
 /*
 if (command.searchFlag == 0) then find function will search for filenames that match searchText
 if (command.searchFlag == 1) then find function will search for files that contain an instance of searchText
+if (command.searchFlag == 2) then find function will search for filenames closest to searchText, see FuzzyMatcher
 */
-void searchDirectories(const Command &command, char *message, int *messageLength, char *directory, bool *foundSomething)
+void searchDirectories(const Command &command, SearchContext &context, char *directory)
 {
-    DIR *dir;
-    struct dirent *entry;
-    dir = opendir(directory);
-    if (dir == NULL) 
+    DirectoryStack &stack = *context.stack;
+    Processes::Progress *progress = context.progress;
+    VisitedSet visited(command.sameFilesystem);
+    context.visited = &visited;
+    stack.setFollowLinks(command.followLinks);
+    stack.setPath(directory);
+    if (!stack.push())
     {
-        appendString(message, "invalid directory ", messageLength);
-        appendString(message, directory, messageLength);
+        appendResult(context, "invalid directory ");
+        appendResult(context, directory);
+        context.visited = NULL;
         return;
     }
-    directoryList.addDIR(&dir);
-
-    while ((entry = readdir(dir)) != NULL) 
+    progress->queueDirectory();
+    enterDirectory(context); // Root is always entered
+
+    ReadScheduler scheduler;
+    FuzzyMatcher fuzzyMatcher(command.searchText, command.maxResults);
+    DirectoryQueue queue;
+    int queuedDepth = 1; // Depth of directory taken from queue, breadth-first stack only ever holds that one
+    const char *filename;
+    Entry_Type type;
+    while (!isSearchFinished(command, context))
     {
-        if (!isPreviousDir(entry->d_name) && !isCurrentDir(entry->d_name))
+        if (stack.isEmpty())
         {
-            char filePath[PATHNAME_LENGTH];
-            fillFilePath(directory, entry->d_name, filePath);
-
-            if (command.searchSubDir && isDirectory(filePath))
-                searchDirectories(command, message, messageLength, filePath, foundSomething);
+            const char *nextDirectory;
+            if (!command.breadthFirst || !queue.pop(&nextDirectory, &queuedDepth))
+                break;
+            stack.setPath(nextDirectory);
+            if (!stack.push())
+            {
+                appendResult(context, "invalid directory ");
+                appendResult(context, nextDirectory);
+                progress->finishDirectory();
+            }
+            else if (!enterDirectory(context))
+                progress->finishDirectory();
+            continue;
+        }
+        if (!stack.nextEntry(&filename, &type))
+        {
+            stack.pop();
+            progress->finishDirectory();
+            continue;
+        }
+        spendBudget(context, false, 1);
+        char *filePath = stack.getPath();
+        int depth = command.breadthFirst ? queuedDepth : stack.getDepth();
+        if (type != ENTRY_DIR)
+            progress->addFile();
 
-            if (command.searchFlag == 0 && strcmp(entry->d_name, command.searchText) == 0) 
+        if (command.searchFlag == 0 && strcmp(filename, command.searchText) == 0) 
+        {
+            if (!context.foundSomething)
             {
-                if (!*foundSomething)
-                {
-                    *foundSomething = true;
-                    appendString(message, "completed.\nFile ", messageLength);
-                    appendString(message, command.searchText, messageLength);
-                    appendString(message, " found at:\n", messageLength);
-                }
-                appendString(message, directory, messageLength);
-                appendString(message, "\n", messageLength);
+                context.foundSomething = true;
+                appendResult(context, "completed.\nFile ");
+                appendResult(context, command.searchText);
+                appendResult(context, " found at:\n");
             }
-            else if (command.searchFlag == 1 && isRegFile(filePath) &&
-                    hasCorrectExtension(entry->d_name, command.fileExtension)  &&
-                    isTextInFile(filePath, command.searchText))
+            int directoryLength = stack.getDirectoryLength();
+            filePath[directoryLength] = 0; // Prints only the directory part of path
+            appendResult(context, filePath);
+            filePath[directoryLength] = '/';
+            appendResult(context, "\n");
+            context.resultCount++;
+        }
+        else if (command.searchFlag == 2)
+            fuzzyMatcher.consider(filename, filePath);
+        else if (command.searchFlag == 1 && type == ENTRY_REG && hasCorrectExtension(filename, command.fileExtension))
+        {
+            if (command.orderedReads)
             {
-                if (!*foundSomething)
+                if (!scheduler.add(filePath, stack.getPathLength(), stack.getEntryInode()))
                 {
-                    *foundSomething = true;
-                    appendString(message, "completed.\nText \"", messageLength);
-                    appendString(message, command.searchText, messageLength);
-                    appendString(message, "\" found in:\n", messageLength);
+                    scheduler.flush(command, context);
+                    scheduler.add(filePath, stack.getPathLength(), stack.getEntryInode());
                 }
-                appendString(message, filePath, messageLength);
-                appendString(message, "\n", messageLength);
+            }
+            else if (isTextInFile(filePath, command.searchText, context))
+                reportTextMatch(command, context, filePath);
+        }
+
+        if (command.searchSubDir && type == ENTRY_DIR && (command.maxDepth == 0 || depth < command.maxDepth))
+        {
+            if (command.breadthFirst)
+            {
+                queue.push(filePath, stack.getPathLength(), depth + 1);
+                progress->queueDirectory();
+            }
+            else if (stack.push())
+            {
+                if (enterDirectory(context))
+                    progress->queueDirectory();
+                continue; // Walks new directory, or pop() has already ended entry
+            }
+            else
+            {
+                appendResult(context, "invalid directory ");
+                appendResult(context, filePath);
             }
         }
+        stack.endEntry();
     }
-    directoryList.removeDIR(&dir);
-    closedir(dir);
-    return;
+    stack.closeAllDIR(); // Only has directories left if search was stopped early
+    scheduler.flush(command, context);
+    if (command.searchFlag == 2 && !isSearchCancelled(context))
+        fuzzyMatcher.report(context);
+    context.visited = NULL;
+}
+
+// Called right after directory is pushed, pops it straight back off if search has already been there or shouldn't go there
+bool enterDirectory(SearchContext &context)
+{
+    DirectoryStack &stack = *context.stack;
+    if (!context.visited->enterDirectory(stack.getDirectoryDevice(), stack.getDirectoryInode(), stack.getPath()))
+    {
+        stack.pop();
+        return false;
+    }
+    context.progress->startDirectory(stack.getPath(), stack.getPathLength());
+    return true;
+}
+
+void reportTextMatch(const Command &command, SearchContext &context, const char *filePath)
+{
+    if (!context.foundSomething)
+    {
+        context.foundSomething = true;
+        appendResult(context, "completed.\nText \"");
+        appendResult(context, command.searchText);
+        appendResult(context, "\" found in:\n");
+    }
+    appendResult(context, filePath);
+    appendResult(context, "\n");
+    if (context.locations != NULL)
+        for (long long location : *context.locations)
+        {
+            appendResult(context, "    at byte ");
+            appendResult(context, to_string(location).c_str());
+            appendResult(context, "\n");
+        }
+    context.resultCount++;
+}
+
+// Printed straight away by REPL searches, and sent to client along with results by daemon
+void reportOpenError(SearchContext &context, const char *filePath)
+{
+    if (context.streamFd != -1)
+        dprintf(context.streamFd, "ERROR: could not open file: %s\n", filePath);
+    else
+        printf("ERROR: could not open file: %s\n", filePath);
+}
+
+bool isSearchCancelled(const SearchContext &context)
+{
+    return context.cancelled != NULL && context.cancelled->load(memory_order_relaxed);
+}
+
+// Checked before every entry and every read, so a reached result limit stops search straight away
+bool isSearchFinished(const Command &command, const SearchContext &context)
+{
+    return (command.maxResults != 0 && context.resultCount >= command.maxResults) || isSearchCancelled(context);
 }
 
-void listCommand()
+void setBudget(Processes::Budget *budget, const Command &command)
+{
+    budget->setRates(command.bytesPerSecond, command.filesPerSecond);
+    if (command.maxThreads != -1)
+        budget->maxThreads = command.maxThreads;
+    if (command.idleIO != -1)
+        budget->idleIO = (command.idleIO == 1);
+}
+
+// Waits until both search's own and global budget allow amount more bytes (or files)
+// Sleeps in short slices, so kill and throttle changes take effect while waiting
+void spendBudget(SearchContext &context, bool isBytes, long long amount)
+{
+    const long long SLEEP_SLICE_NS = 10000000;
+    Processes::Budget *globalBudget = processList->getGlobalBudget();
+    applyIOPriority(context);
+    long long ownWait = context.budget->reserve(isBytes, amount);
+    long long globalWait = globalBudget->reserve(isBytes, amount);
+    if (ownWait <= 0 && globalWait <= 0)
+        return;
+    while (!isSearchCancelled(context))
+    {
+        long long wait = max(context.budget->getWait(isBytes), globalBudget->getWait(isBytes));
+        if (wait <= 0)
+            return;
+        struct timespec slice = { 0, min(wait, SLEEP_SLICE_NS) };
+        nanosleep(&slice, NULL);
+    }
+}
+
+// Idle class only gets disk time nobody else wants, ioprio is per thread so this works for daemon searches too
+void applyIOPriority(SearchContext &context)
+{
+    const int IOPRIO_WHO_PROCESS = 1;
+    const int IOPRIO_CLASS_SHIFT = 13;
+    const int IOPRIO_CLASS_IDLE = 3;
+    bool idleIO = context.budget->idleIO.load(memory_order_relaxed) ||
+                  processList->getGlobalBudget()->idleIO.load(memory_order_relaxed);
+    if (idleIO == context.idleIO)
+        return;
+    int priority = idleIO ? (IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) : 0; // 0 goes back to default from nice value
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, (int)syscall(SYS_gettid), priority);
+    context.idleIO = idleIO;
+}
+
+bool listCommand(int outputFd)
 {
     int serialNumbers[Processes::MAX_PROCESSES];
     processList->getSerialNumbers(serialNumbers);
@@ -462,30 +1064,125 @@ void listCommand()
         {
             processesAreActive = true;
             Processes::ProcessData pd = processList->getProcessData(serialNumbers[i], searchTerm, fileExtension);
-            printf("Process %d: searching for ", serialNumbers[i]);
-            if (pd.searchFlag == 0)
+            dprintf(outputFd, "Process %d: searching for ", serialNumbers[i]);
+            if (pd.searchFlag == 0 || pd.searchFlag == 2)
             {
-                printf("file %s ", searchTerm);
+                dprintf(outputFd, (pd.searchFlag == 0) ? "file %s " : "file like %s ", searchTerm);
                 if (pd.isRecursive)
-                    printf("recursively.\n");
+                    dprintf(outputFd, "recursively.\n");
                 else
-                    printf("in current directory.\n");
+                    dprintf(outputFd, "in current directory.\n");
             }
             else
             {
-                printf("text \"%s\" ", searchTerm);
+                dprintf(outputFd, "text \"%s\" ", searchTerm);
                 if (pd.isRecursive)
-                    printf("recursively ");
+                    dprintf(outputFd, "recursively ");
                 else
-                    printf("in current directory ");
-                printf("in all ");
+                    dprintf(outputFd, "in current directory ");
+                dprintf(outputFd, "in all ");
                 if (fileExtension[0] != 0)
-                    printf("%s ", fileExtension);
-                printf("files.\n");
+                    dprintf(outputFd, "%s ", fileExtension);
+                dprintf(outputFd, "files.\n");
             }
+            printProgress(outputFd, processList->getProgress(serialNumbers[i]));
+            Processes::Budget *budget = processList->getBudget(serialNumbers[i]);
+            if (budget != NULL)
+                printBudget(outputFd, budget);
         }
     if (!processesAreActive)
-        printf("There are no processes currently running.\n");
+        dprintf(outputFd, "There are no processes currently running.\n");
+    return processesAreActive;
+}
+
+void printProgress(int outputFd, Processes::Progress *progress)
+{
+    char bytesString[16];
+    char rateString[16];
+    char currentPath[PATHNAME_LENGTH];
+    fillByteString(progress->bytesScanned.load(memory_order_relaxed), bytesString);
+    fillByteString(progress->bytesPerSecond.load(memory_order_relaxed), rateString);
+    progress->getCurrentPath(currentPath);
+    long long idleSeconds = (getSteadyTime() - progress->lastActivity.load(memory_order_relaxed)) / 1000000000;
+
+    dprintf(outputFd, "    %llu directories done, %llu queued, %llu files, %s read\n",
+            progress->directoriesDone.load(memory_order_relaxed), progress->directoriesQueued.load(memory_order_relaxed),
+            progress->filesScanned.load(memory_order_relaxed), bytesString);
+    if (idleSeconds > 1)
+        dprintf(outputFd, "    No progress for %lld s\n", idleSeconds);
+    else
+        dprintf(outputFd, "    %llu files/s, %s/s\n", progress->filesPerSecond.load(memory_order_relaxed), rateString);
+    dprintf(outputFd, "    In %s\n", currentPath);
+}
+
+void throttleCommand(int outputFd, const Command &command)
+{
+    Processes::Budget *budget = (command.id == -1) ? processList->getGlobalBudget() : processList->getBudget(command.id);
+    if (budget == NULL)
+    {
+        dprintf(outputFd, "Process %d could not be throttled.\n", command.id);
+        dprintf(outputFd, "This was either an invalid entry or this process has already finished running.\n");
+        return;
+    }
+    setBudget(budget, command);
+    if (command.id == -1)
+        dprintf(outputFd, "All processes together:\n");
+    else
+        dprintf(outputFd, "Process %d:\n", command.id);
+    printBudget(outputFd, budget);
+}
+
+void printBudget(int outputFd, Processes::Budget *budget)
+{
+    long long bytesRate = budget->bytesPerSecond.load(memory_order_relaxed);
+    long long filesRate = budget->filesPerSecond.load(memory_order_relaxed);
+    int maxThreads = budget->maxThreads.load(memory_order_relaxed);
+    bool idleIO = budget->idleIO.load(memory_order_relaxed);
+    if (bytesRate == 0 && filesRate == 0 && maxThreads == 0 && !idleIO)
+        return;
+
+    char rateString[16];
+    dprintf(outputFd, "    Limited to");
+    if (bytesRate != 0)
+    {
+        fillByteString(bytesRate, rateString);
+        dprintf(outputFd, " %s/s", rateString);
+    }
+    if (filesRate != 0)
+        dprintf(outputFd, " %lld files/s", filesRate);
+    if (maxThreads != 0)
+        dprintf(outputFd, " %d threads", maxThreads);
+    if (idleIO)
+        dprintf(outputFd, " idle I/O");
+    dprintf(outputFd, "\n");
+}
+
+// Repeats list command until no searches are left or user presses Enter
+void watchCommand(int outputFd, int interval, bool *stdinOverwritten)
+{
+    while (true)
+    {
+        if (dprintf(outputFd, "\033[H\033[2J") < 0) // Fails once daemon client has gone
+            return;
+        if (!listCommand(outputFd))
+            return;
+        dprintf(outputFd, "Refreshing every %d s. Press Enter to stop.\n", interval);
+
+        if (stdinOverwritten == NULL)
+            sleep(interval);
+        else
+        {
+            struct pollfd input = { STDIN_FILENO, POLLIN, 0 };
+            int ready = poll(&input, 1, interval * 1000);
+            if (ready > 0 && !*stdinOverwritten)
+            {
+                char discard[PIPE_CAPACITY];
+                read(STDIN_FILENO, discard, PIPE_CAPACITY);
+            }
+            if (ready != 0) // Also interrupted when a finished search swaps stdin to print its results
+                return;
+        }
+    }
 }
 
 void killCommand(int killSerialNumber, bool writeOutput)
@@ -515,97 +1212,627 @@ bool quitCommand()
     return false;
 }
 
-void fillFilePath(char *directory, char *filename, char *filePath) 
-{
-    strcpy(filePath, directory);
-    filePath[strlen(directory)] = '/';
-    strcpy(filePath + strlen(directory) + 1, filename);
-}
-
-bool isDirectory(const char *filePath)
+// Socket goes in user's runtime directory, or else in a /tmp directory only they can use, so no other user can stand in for daemon
+const char *getDefaultSocketPath(char path[PATHNAME_LENGTH])
 {
-    struct stat sb;
-    int check = stat(filePath, &sb);
-    if (S_ISDIR(sb.st_mode))
-        return true;
-    return false;
-}
+    const char *runtimeDirectory = getenv("XDG_RUNTIME_DIR");
+    if (runtimeDirectory != NULL && runtimeDirectory[0] == '/')
+    {
+        snprintf(path, PATHNAME_LENGTH, "%s/%s", runtimeDirectory, SOCKET_NAME);
+        return path;
+    }
 
-bool isRegFile(const char *filePath)
-{
+    char directory[32];
+    snprintf(directory, sizeof(directory), "/tmp/findstuff-%d", (int)getuid());
+    mkdir(directory, 0700);
     struct stat sb;
-    int check = stat(filePath, &sb);
-    if (S_ISREG(sb.st_mode))
-        return true;
-    return false;
-}
-
-bool hasCorrectExtension(const char *filename, const char *fileExtension) {
-    int extSize = strlen(fileExtension);
-    if (extSize == 0)
-        return true;
-
-    int nameSize = strlen(filename);
-    int sizeDiff = nameSize - extSize;
-
-    int i = nameSize - 1;
-    for (int j = i - sizeDiff; j >= 0; i--, j--)
-        if (filename[i] != fileExtension[j])
-            return false;
-    if (filename[i] != '.')
-        return false;
-
-    return true;
+    if (lstat(directory, &sb) == -1 || !S_ISDIR(sb.st_mode) || sb.st_uid != getuid() || (sb.st_mode & 077) != 0)
+        return NULL;
+    snprintf(path, PATHNAME_LENGTH, "%s/%s", directory, SOCKET_NAME);
+    return path;
 }
 
-bool isTextInFile(const char *filePath, const char *searchText)
+int runDaemon(const char *socketPath)
 {
-    FILE *file = fopen(filePath, "r");
-    if (file == NULL) 
+    struct sockaddr_un address;
+    if (strlen(socketPath) >= sizeof(address.sun_path))
     {
-        printf("ERROR: could not open file: %s\n", filePath);
-        return false;
+        printf("ERROR. Socket path %s is too long.\n", socketPath);
+        return 1;
+    }
+    int probeFd = connectToDaemon(socketPath);
+    if (probeFd != -1)
+    {
+        close(probeFd);
+        printf("ERROR. A daemon is already listening on %s.\n", socketPath);
+        return 1;
+    }
+    unlink(socketPath); // Left behind by a daemon that didn't shut down cleanly
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socketPath);
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd == -1 || bind(listenFd, (struct sockaddr*)&address, sizeof(address)) == -1 || chmod(socketPath, 0600) == -1 ||
+        listen(listenFd, SOMAXCONN) == -1)
+    {
+        printf("ERROR. Could not listen on %s.\n", socketPath);
+        return 1;
     }
-    fseek(file, 0, SEEK_END);
-    long int size = ftell(file);
-    rewind(file);
 
-    char* fileContents = new char[size + 1];
-    fread(fileContents, 1, size, file);
-    fileContents[size] = 0;
-    fclose(file);
+    signal(SIGPIPE, SIG_IGN); // Client disconnecting mid-search cancels that search instead of killing daemon
+    processList->initialize();
+    directoryCache = new DirectoryCache;
+    printf("Daemon listening on %s\n", socketPath);
+    fflush(stdout);
 
-    if (strstr(fileContents, searchText)) 
+    while (true)
     {
-        delete[] fileContents;
-        return true;
+        int clientFd = accept(listenFd, NULL, NULL);
+        if (clientFd != -1)
+            thread(serveClient, clientFd).detach();
     }
-    delete[] fileContents;
-    return false;
+    return 0;
 }
 
-// For use only with fillPrintMessage() and searchDirectories()
-// Assumes mainString is of length global const int PIPE_CAPACITY
-void appendString(char *mainString, const char *stringToAppend, int *mainStringSize)
+/*
+Request is the client's working directory and one REPL command line, each ending in '\n'
+Response is whatever the REPL would have printed for that command, connection closes when it's done
+*/
+void serveClient(int clientFd)
 {
-    int totalSize = *mainStringSize + strlen(stringToAppend);
-    if (totalSize > PIPE_CAPACITY)
+    // Searches run with daemon's permissions, so only its own user may ask for them
+    struct ucred peer;
+    socklen_t peerLength = sizeof(peer);
+    if (getsockopt(clientFd, SOL_SOCKET, SO_PEERCRED, &peer, &peerLength) == -1 || peer.uid != getuid())
     {
-        int availableSpace = PIPE_CAPACITY - *mainStringSize;
-        if (availableSpace == 0)
-            return;
-        char newString[availableSpace];
-        memcpy(newString, stringToAppend, availableSpace - 1);
-        newString[availableSpace - 1] = 0;
-        newString[availableSpace - 2] = '\n';
-        strcpy(mainString + *mainStringSize, newString);
-        *mainStringSize = PIPE_CAPACITY;
+        close(clientFd);
+        return;
     }
-    else
+
+    char request[PATHNAME_LENGTH + PIPE_CAPACITY];
+    int requestLength = 0;
+    int newlines = 0;
+    long long deadline = getSteadyTime() + REQUEST_TIMEOUT * 1000000LL; // Client that never finishes its request can't hold a thread
+    while (newlines < 2 && requestLength < (int)sizeof(request))
     {
-        strcpy(mainString + *mainStringSize, stringToAppend);
-        *mainStringSize = totalSize;
+        struct pollfd pfd = { clientFd, POLLIN, 0 };
+        int timeLeft = (deadline - getSteadyTime()) / 1000000;
+        if (timeLeft <= 0 || poll(&pfd, 1, timeLeft) <= 0)
+            break;
+        int bytesRead = read(clientFd, request + requestLength, sizeof(request) - requestLength);
+        if (bytesRead <= 0)
+            break;
+        for (int i = requestLength; i < requestLength + bytesRead; i++)
+            if (request[i] == '\n')
+                newlines++;
+        requestLength += bytesRead;
     }
+    if (newlines < 2)
+    {
+        dprintf(clientFd, "ERROR. Incomplete request.\n");
+        close(clientFd);
+        return;
+    }
+
+    char *directory = request;
+    char *commandLine = strchr(request, '\n') + 1;
+    commandLine[-1] = 0;
+    int commandLength = strchr(commandLine, '\n') - commandLine + 1;
+
+    char *arg[MAX_ARGUMENTS] = {NULL};
+    if (!parseInput(commandLine, commandLength, arg, clientFd))
+    {
+        close(clientFd);
+        return;
+    }
+    Command command = parseCommand(arg, clientFd);
+    if (command.commandType == Command_Type::FIND)
+    {
+        int serialNumber = processList->addProcess(command.searchText, command.fileExtension, command.searchSubDir, command.searchFlag);
+        atomic<bool> *cancelled = (serialNumber == -1) ? NULL : processList->getCancelFlag(serialNumber);
+        DirectoryStack stack;
+        Processes::Progress *progress = (serialNumber == -1) ? NULL : processList->getProgress(serialNumber);
+        Processes::Budget *budget = (serialNumber == -1) ? NULL : processList->getBudget(serialNumber);
+        vector<long long> locations;
+        int stopPipe[2];
+        thread watcher;
+        if (cancelled != NULL && pipe(stopPipe) == 0)
+            watcher = thread(watchClient, clientFd, stopPipe[0], cancelled);
+        SearchContext context = { NULL, NULL, clientFd, directory, false, 0, &stack, cancelled, progress, budget, false,
+                                  serialNumber, command.showLocations ? &locations : NULL, NULL, 0 };
+        fillPrintMessage(command, context, serialNumber);
+        if (watcher.joinable())
+        {
+            close(stopPipe[1]); // Wakes watcher up
+            watcher.join();
+            close(stopPipe[0]);
+        }
+        if (serialNumber != -1)
+            processList->removeProcess(serialNumber);
+    }
+    else if (command.commandType == Command_Type::LIST)
+        listCommand(clientFd);
+    else if (command.commandType == Command_Type::WATCH)
+        watchCommand(clientFd, command.interval, NULL);
+    else if (command.commandType == Command_Type::THROTTLE)
+        throttleCommand(clientFd, command);
+    else if (command.commandType == Command_Type::KILL)
+    {
+        if (processList->cancelProcess(command.id))
+            dprintf(clientFd, "Process %d has been killed\n", command.id);
+        else
+        {
+            dprintf(clientFd, "Process %d could not be killed.\n", command.id);
+            dprintf(clientFd, "This was either an invalid entry or this process has already finished running.\n");
+        }
+    }
+    else if (command.commandType != Command_Type::INVALID) // parseCommand() has already sent error
+        dprintf(clientFd, "ERROR. Command not supported by daemon.\n");
+    close(clientFd);
+}
+
+// Cancels search as soon as client hangs up, as a search that finds nothing would otherwise never try writing to notice
+// Only returns after that or once stopFd is closed
+void watchClient(int clientFd, int stopFd, atomic<bool> *cancelled)
+{
+    struct pollfd fds[2] = { { clientFd, POLLRDHUP, 0 }, { stopFd, POLLIN, 0 } };
+    while (poll(fds, 2, -1) == -1 && errno == EINTR);
+    if (fds[0].revents != 0)
+        cancelled->store(true);
+}
+
+// Thin REPL that validates commands locally and has the daemon run them
+int runClient(const char *socketPath)
+{
+    vector<int> relayPIDs;
+    char userInput[PIPE_CAPACITY];
+    while (true)
+    {
+        for (int i = relayPIDs.size() - 1; i >= 0; i--)
+            if (waitpid(relayPIDs[i], NULL, WNOHANG) == relayPIDs[i])
+                relayPIDs.erase(relayPIDs.begin() + i);
+
+        printf("\033[1;94;49mfindstuff\033[0m$ ");
+        fflush(stdout);
+        int inputSize = read(STDIN_FILENO, userInput, PIPE_CAPACITY - 1);
+        if (inputSize <= 0)
+            break;
+        if (userInput[inputSize - 1] != '\n')
+            userInput[inputSize++] = '\n';
+        int inputLength = 1;
+        for (; userInput[inputLength - 1] != '\n'; inputLength++);
+
+        char *arg[MAX_ARGUMENTS] = {NULL};
+        if (!parseInput(userInput, inputLength, arg, STDOUT_FILENO))
+            continue;
+        Command command = parseCommand(arg, STDOUT_FILENO);
+        if (command.commandType == Command_Type::QUIT)
+            break;
+        if (command.commandType == Command_Type::INVALID)
+            continue;
+
+        if (command.commandType == Command_Type::FIND)
+        {
+            int pid = fork();
+            if (pid != 0) // Child relays results, so they interrupt the prompt like REPL searches do
+            {
+                relayPIDs.push_back(pid);
+                continue;
+            }
+        }
+        int socketFd = connectToDaemon(socketPath);
+        if (socketFd == -1)
+            printf("ERROR. Could not connect to daemon at %s.\n", socketPath);
+        else
+        {
+            if (sendRequest(socketFd, userInput, inputLength))
+                relayResponse(socketFd, command.commandType == Command_Type::WATCH);
+            close(socketFd);
+        }
+        if (command.commandType == Command_Type::FIND)
+        {
+            printf("\033[1;94;49mfindstuff\033[0m$ ");
+            fflush(stdout);
+            _exit(0);
+        }
+    }
+
+    for (int pid : relayPIDs) // Daemon cancels each search once its client is gone
+    {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+    return 0;
+}
+
+int connectToDaemon(const char *socketPath)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath, sizeof(address.sun_path) - 1);
+
+    int socketFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socketFd == -1)
+        return -1;
+    if (connect(socketFd, (struct sockaddr*)&address, sizeof(address)) == -1)
+    {
+        close(socketFd);
+        return -1;
+    }
+
+    // Results are only trusted from a daemon run by same user
+    struct ucred peer;
+    socklen_t peerLength = sizeof(peer);
+    if (getsockopt(socketFd, SOL_SOCKET, SO_PEERCRED, &peer, &peerLength) == -1 || peer.uid != getuid())
+    {
+        close(socketFd);
+        return -1;
+    }
+    return socketFd;
+}
+
+bool sendRequest(int socketFd, const char *command, int commandLength)
+{
+    char directory[PATHNAME_LENGTH];
+    getcwd(directory, PATHNAME_LENGTH);
+    return writeAll(socketFd, directory, strlen(directory)) && writeAll(socketFd, "\n", 1) &&
+           writeAll(socketFd, command, commandLength);
+}
+
+// With stopOnInput, an entered line ends relay early, closing the socket tells daemon to stop
+void relayResponse(int socketFd, bool stopOnInput)
+{
+    char buffer[PIPE_CAPACITY];
+    struct pollfd fds[2] = { { socketFd, POLLIN, 0 }, { STDIN_FILENO, POLLIN, 0 } };
+    while (poll(fds, stopOnInput ? 2 : 1, -1) > 0)
+    {
+        if (stopOnInput && fds[1].revents != 0)
+        {
+            read(STDIN_FILENO, buffer, PIPE_CAPACITY);
+            return;
+        }
+        int bytesRead = read(socketFd, buffer, PIPE_CAPACITY);
+        if (bytesRead <= 0)
+            return;
+        writeAll(STDOUT_FILENO, buffer, bytesRead);
+    }
+}
+
+void fillFilePath(const char *directory, const char *filename, char *filePath) 
+{
+    strcpy(filePath, directory);
+    filePath[strlen(directory)] = '/';
+    strcpy(filePath + strlen(directory) + 1, filename);
+}
+
+// Uses dirent's d_type when filesystem provides it, only symlinks and unknown types cost a stat()
+// Symlinks get type of what they point to, and isLink is set so caller can choose not to follow them
+Entry_Type getEntryType(const char *filePath, unsigned char dType, bool *isLink)
+{
+    *isLink = (dType == DT_LNK);
+    if (dType == DT_DIR)
+        return ENTRY_DIR;
+    if (dType == DT_REG)
+        return ENTRY_REG;
+    if (dType == DT_LNK || dType == DT_UNKNOWN)
+    {
+        struct stat sb;
+        int result = (dType == DT_LNK) ? stat(filePath, &sb) : lstat(filePath, &sb);
+        if (result == 0 && S_ISLNK(sb.st_mode))
+        {
+            *isLink = true;
+            result = stat(filePath, &sb);
+        }
+        if (result == 0)
+        {
+            if (S_ISDIR(sb.st_mode))
+                return ENTRY_DIR;
+            if (S_ISREG(sb.st_mode))
+                return ENTRY_REG;
+        }
+    }
+    return ENTRY_OTHER;
+}
+
+bool hasCorrectExtension(const char *filename, const char *fileExtension) {
+    int extSize = strlen(fileExtension);
+    if (extSize == 0)
+        return true;
+
+    int nameSize = strlen(filename);
+    int sizeDiff = nameSize - extSize;
+
+    int i = nameSize - 1;
+    for (int j = i - sizeDiff; j >= 0; i--, j--)
+        if (filename[i] != fileExtension[j])
+            return false;
+    if (filename[i] != '.')
+        return false;
+
+    return true;
+}
+
+int parsePositiveInt(const char *str)
+{
+    int value = 0;
+    for (int i = 0; str[i] != 0; i++)
+    {
+        if (str[i] < '0' || str[i] > '9' || value > 100000000)
+            return -1;
+        value = value * 10 + (str[i] - '0');
+    }
+    return (value > 0) ? value : -1;
+}
+
+// Accepts K, M and G suffixes, for throttle rates
+long long parseAmount(const char *str)
+{
+    long long value = 0;
+    int i = 0;
+    for (; str[i] >= '0' && str[i] <= '9'; i++)
+    {
+        if (value > 1000000000000LL)
+            return -1;
+        value = value * 10 + (str[i] - '0');
+    }
+    if (i == 0)
+        return -1;
+    long long multiplier = 1;
+    if (str[i] == 'K' || str[i] == 'k')
+        multiplier = 1024;
+    else if (str[i] == 'M' || str[i] == 'm')
+        multiplier = 1024 * 1024;
+    else if (str[i] == 'G' || str[i] == 'g')
+        multiplier = 1024 * 1024 * 1024;
+    else if (str[i] != 0)
+        return -1;
+    if (str[i] != 0 && str[i + 1] != 0)
+        return -1;
+    if (value > LLONG_MAX / multiplier) // Would otherwise wrap negative, which means no limit
+        return -1;
+    return value * multiplier;
+}
+
+// Shared by find and throttle commands
+// Returns how many arguments option at arg[i] used, 0 if it isn't a throttle option and -1 if it's malformed
+int parseBudgetOption(char *arg[], int i, Command &command, int outputFd)
+{
+    if (strcmp(arg[i], "--idle") == 0 || strcmp(arg[i], "--normal") == 0)
+    {
+        command.idleIO = (arg[i][2] == 'i') ? 1 : 0;
+        return 1;
+    }
+    if (strcmp(arg[i], "--bps") != 0 && strcmp(arg[i], "--fps") != 0 && strcmp(arg[i], "-j") != 0)
+        return 0;
+
+    long long value = (i + 1 < MAX_ARGUMENTS && arg[i + 1] != NULL) ? parseAmount(arg[i + 1]) : -1;
+    bool isThreads = (arg[i][1] == 'j');
+    if (value == -1 || (isThreads && (value > 1024 || strspn(arg[i + 1], "0123456789") != strlen(arg[i + 1])))) // No suffixes for threads
+    {
+        dprintf(outputFd, "ERROR. Expected number after %s, 0 removes limit.\n", arg[i]);
+        return -1;
+    }
+    if (strcmp(arg[i], "--bps") == 0)
+        command.bytesPerSecond = value;
+    else if (strcmp(arg[i], "--fps") == 0)
+        command.filesPerSecond = value;
+    else
+        command.maxThreads = value;
+    return 2;
+}
+
+bool isTextInFile(const char *filePath, const char *searchText, SearchContext &context)
+{
+    int fileFd = open(filePath, O_RDONLY);
+    if (fileFd == -1) 
+    {
+        reportOpenError(context, filePath);
+        return false;
+    }
+    bool found = isTextInOpenFile(fileFd, searchText, context);
+    close(fileFd);
+    return found;
+}
+
+bool isTextInOpenFile(int fileFd, const char *searchText, SearchContext &context)
+{
+    struct stat sb;
+    if (fstat(fileFd, &sb) == -1)
+        return false;
+    long long size = sb.st_size;
+    if (context.locations != NULL)
+        context.locations->clear();
+
+    // Every link to a file is reported, but it's only read through first one
+    bool hasLinks = context.visited != NULL && sb.st_nlink > 1;
+    bool found;
+    if (hasLinks && context.visited->getFileResult(sb.st_dev, sb.st_ino, &found, context.locations))
+        return found;
+    if (size >= 4 * SCAN_RANGE_SIZE)
+        found = isTextInLargeFile(fileFd, size, searchText, context);
+    else
+        found = isTextInSmallFile(fileFd, size, searchText, context);
+    if (hasLinks && !isSearchCancelled(context))
+        context.visited->setFileResult(sb.st_dev, sb.st_ino, found, context.locations);
+    return found;
+}
+
+bool isTextInSmallFile(int fileFd, long long size, const char *searchText, SearchContext &context)
+{
+    char* fileContents = new char[size + 1];
+    long long bytesRead = 0;
+    while (bytesRead < size)
+    {
+        long long chunkSize = min(size - bytesRead, READ_CHUNK);
+        long long prepaid = min(chunkSize, context.prepaidBytes);
+        context.prepaidBytes -= prepaid;
+        spendBudget(context, true, chunkSize - prepaid);
+        if (isSearchCancelled(context))
+            break;
+        long long chunk = read(fileFd, fileContents + bytesRead, chunkSize);
+        if (chunk <= 0)
+            break;
+        bytesRead += chunk;
+        context.progress->addBytes(chunk);
+    }
+
+    bool found = findText(fileContents, bytesRead, searchText, strlen(searchText), 0, bytesRead, context.locations);
+    delete[] fileContents;
+    return found;
+}
+
+/*
+File is split into SCAN_RANGE_SIZE ranges that the search thread and as many extra threads as its limits allow take in turn
+Each range is read with length of searchText - 1 extra bytes, so a match crossing into next range is still found
+Ranges are read READ_CHUNK at a time, keeping last length of searchText - 1 bytes, so every thread only holds about READ_CHUNK
+Without -l all threads stop once any range has a match, with -l every range is scanned and offsets are merged in range order
+*/
+bool isTextInLargeFile(int fileFd, long long size, const char *searchText, SearchContext &context)
+{
+    int textLength = strlen(searchText);
+    int carry = max(textLength - 1, 0);
+    long long prepaid = context.prepaidBytes; // Start of first range, taken out before workers copy context
+    context.prepaidBytes = 0;
+    long long rangeCount = (size + SCAN_RANGE_SIZE - 1) / SCAN_RANGE_SIZE;
+    atomic<long long> nextRange(0);
+    atomic<bool> found(false);
+    vector<vector<long long>> rangeLocations(context.locations != NULL ? rangeCount : 0);
+
+    auto scanRanges = [&](SearchContext &workerContext)
+    {
+        char *buffer = new char[READ_CHUNK + carry];
+        while (!isSearchCancelled(workerContext) && (context.locations != NULL || !found.load(memory_order_relaxed)))
+        {
+            long long range = nextRange.fetch_add(1, memory_order_relaxed);
+            if (range >= rangeCount)
+                break;
+            long long rangeEnd = min((range + 1) * SCAN_RANGE_SIZE, size); // Matches have to start before this
+            long long readEnd = min(rangeEnd + carry, size);
+            long long position = range * SCAN_RANGE_SIZE; // Next offset to read
+            long long bufferOffset = position; // Offset of buffer[0]
+            int kept = 0;
+            while (position < readEnd && !isSearchCancelled(workerContext) &&
+                   (context.locations != NULL || !found.load(memory_order_relaxed)))
+            {
+                long long wanted = min(readEnd - position, READ_CHUNK);
+                spendBudget(workerContext, true, (position == 0) ? wanted - min(wanted, prepaid) : wanted);
+                long long chunk = pread(fileFd, buffer + kept, wanted, position);
+                if (chunk <= 0)
+                    break;
+                position += chunk;
+                workerContext.progress->addBytes(chunk);
+
+                // Matches starting in kept tail are left for next chunk, which sees all of them
+                long long length = kept + chunk;
+                long long startLimit = rangeEnd - bufferOffset;
+                if (position < readEnd)
+                    startLimit = min(startLimit, length - carry);
+                if (findText(buffer, length, searchText, textLength, bufferOffset, startLimit,
+                             context.locations != NULL ? &rangeLocations[range] : NULL))
+                    found = true;
+                kept = min((long long)carry, length);
+                memmove(buffer, buffer + length - kept, kept);
+                bufferOffset += length - kept;
+            }
+        }
+        delete[] buffer;
+    };
+
+    int maxThreads = context.budget->maxThreads.load(memory_order_relaxed);
+    if (maxThreads == 0)
+        maxThreads = max(1u, thread::hardware_concurrency());
+    int extraWorkers = min((long long)maxThreads, rangeCount) - 1;
+    vector<SearchContext> workerContexts(max(extraWorkers, 0), context);
+    vector<thread> workers;
+    for (int i = 0; i < extraWorkers && processList->tryAddWorker(context.serialNumber); i++)
+    {
+        workerContexts[i].idleIO = false; // New thread starts at normal priority
+        workers.push_back(thread(scanRanges, ref(workerContexts[i])));
+    }
+    scanRanges(context);
+    for (thread &worker : workers)
+    {
+        worker.join();
+        processList->removeWorker(context.serialNumber);
+    }
+
+    if (context.locations != NULL)
+        for (vector<long long> &locations : rangeLocations)
+            context.locations->insert(context.locations->end(), locations.begin(), locations.end());
+    return found;
+}
+
+// Finds searchText in buffer holding file from offset on, only matches starting before startLimit are counted
+// Stops at first match unless every location is wanted
+bool findText(const char *buffer, long long length, const char *searchText, int textLength, long long offset, long long startLimit,
+              vector<long long> *locations)
+{
+    bool found = false;
+    const char *start = buffer;
+    const char *end = buffer + length;
+    const char *match;
+    while ((match = (const char*)memmem(start, end - start, searchText, textLength)) != NULL && match - buffer < startLimit)
+    {
+        found = true;
+        if (locations == NULL)
+            break;
+        locations->push_back(offset + (match - buffer));
+        if (textLength == 0)
+            break;
+        start = match + 1;
+    }
+    return found;
+}
+
+// For use only with fillPrintMessage() and searchDirectories()
+// Assumes mainString is of length global const int PIPE_CAPACITY
+void appendString(char *mainString, const char *stringToAppend, int *mainStringSize)
+{
+    int totalSize = *mainStringSize + strlen(stringToAppend);
+    if (totalSize > PIPE_CAPACITY)
+    {
+        int availableSpace = PIPE_CAPACITY - *mainStringSize;
+        if (availableSpace == 0)
+            return;
+        char newString[availableSpace];
+        memcpy(newString, stringToAppend, availableSpace - 1);
+        newString[availableSpace - 1] = 0;
+        newString[availableSpace - 2] = '\n';
+        strcpy(mainString + *mainStringSize, newString);
+        *mainStringSize = PIPE_CAPACITY;
+    }
+    else
+    {
+        strcpy(mainString + *mainStringSize, stringToAppend);
+        *mainStringSize = totalSize;
+    }
+}
+
+// Streams to daemon client when there is one, otherwise collects into REPL's message
+void appendResult(SearchContext &context, const char *stringToAppend)
+{
+    if (context.streamFd != -1)
+    {
+        if (!writeAll(context.streamFd, stringToAppend, strlen(stringToAppend)) && context.cancelled != NULL)
+            context.cancelled->store(true); // Client has disconnected, nobody is left to read results
+    }
+    else
+        appendString(context.message, stringToAppend, context.messageLength);
+}
+
+bool writeAll(int fd, const char *buffer, int size)
+{
+    while (size > 0)
+    {
+        int written = write(fd, buffer, size);
+        if (written <= 0)
+            return false;
+        buffer += written;
+        size -= written;
+    }
+    return true;
 }
 
 void waitRunningProcesses(bool shouldHang)
@@ -658,12 +1885,28 @@ void fillTimeEllapsedString(float timeInSeconds, char str[13])
     }
 }
 
+void fillByteString(unsigned long long bytes, char str[16])
+{
+    const char *units[] = { "B", "KB", "MB", "GB", "TB" };
+    double value = bytes;
+    int unit = 0;
+    for (; value >= 1024 && unit < 4; unit++)
+        value /= 1024;
+    snprintf(str, 16, (unit == 0) ? "%.0f %s" : "%.1f %s", value, units[unit]);
+}
+
+// Monotonic across processes, so REPL can compare times published by its searches
+long long getSteadyTime()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 // Child is finished anyway once it's in writing process
 void childKill(int i)
 {
     if (!childIsWriting)
     {
-        directoryList.closeAllDIRAndDestroy();
+        directoryStack.closeAllDIR();
         processList->removeSelf();
         kill(getpid(), SIGTERM);
     }       
@@ -671,8 +1914,12 @@ void childKill(int i)
 
 void Processes::initialize()
 {
+    globalBudget.reset();
     for (int i = 0; i < MAX_PROCESSES; i++)
+    {
         processes[i].active = false;
+        processes[i].cancelled = false;
+    }
 
 }
 
@@ -690,6 +1937,10 @@ int Processes::addProcess(const char *searchTerm, const char *fileExtension, con
             processes[i].isRecursive = isRecursive;
             processes[i].searchFlag = searchFlag;
             processes[i].isWriting = false;
+            processes[i].cancelled = false;
+            processes[i].progress.reset();
+            processes[i].budget.reset();
+            processes[i].workers = 0;
             mtx.unlock();
             return i;
         }
@@ -800,65 +2051,709 @@ bool Processes::isProcessWriting(int serialNumber)
     return false; 
 } 
 
-Directories::~Directories()
+bool Processes::cancelProcess(int serialNumber)
 {
-    node *current = root;
-    while (current != NULL)
+    mtx.lock();
+    if (processes[serialNumber].active)
     {
-        node *next = current->next;
-        delete current;
-        current = next;
+        processes[serialNumber].cancelled = true;
+        mtx.unlock();
+        return true;
     }
+    mtx.unlock();
+    return false;
 }
 
-void Directories::addDIR(DIR **dir)
+atomic<bool> *Processes::getCancelFlag(int serialNumber)
 {
-    node *newNode = new node;
-    newNode->dir = dir;
-    newNode->next = NULL;
+    return &processes[serialNumber].cancelled;
+}
 
-    if (root == NULL)
-        root = newNode;
-    else
+Processes::Progress *Processes::getProgress(int serialNumber)
+{
+    return &processes[serialNumber].progress;
+}
+
+Processes::Budget *Processes::getBudget(int serialNumber)
+{
+    mtx.lock();
+    Budget *budget = processes[serialNumber].active ? &processes[serialNumber].budget : NULL;
+    mtx.unlock();
+    return budget;
+}
+
+// Threads are counted per process, so a killed search's threads stop counting once its entry is removed
+bool Processes::tryAddWorker(int serialNumber)
+{
+    int maxThreads = globalBudget.maxThreads.load(memory_order_relaxed);
+    mtx.lock();
+    int workers = 0;
+    for (int i = 0; i < MAX_PROCESSES; i++)
+        if (processes[i].active)
+            workers += processes[i].workers;
+    bool added = (maxThreads == 0 || workers < maxThreads);
+    if (added)
+        processes[serialNumber].workers++;
+    mtx.unlock();
+    return added;
+}
+
+void Processes::removeWorker(int serialNumber)
+{
+    mtx.lock();
+    if (processes[serialNumber].workers > 0)
+        processes[serialNumber].workers--;
+    mtx.unlock();
+}
+
+void Processes::Budget::reset()
+{
+    bytesPerSecond = 0;
+    filesPerSecond = 0;
+    maxThreads = 0;
+    idleIO = false;
+    bytesReadyTime = 0;
+    filesReadyTime = 0;
+}
+
+// Any debt built up under old rate is dropped, so raising or removing a limit takes effect right away
+void Processes::Budget::setRates(long long bytesRate, long long filesRate)
+{
+    long long now = getSteadyTime();
+    if (bytesRate != -1)
     {
-        node *occupied = root;
-        for (; occupied->next != NULL; occupied = occupied->next);
-        occupied->next = newNode;
+        bytesPerSecond = bytesRate;
+        bytesReadyTime = now;
     }
+    if (filesRate != -1)
+    {
+        filesPerSecond = filesRate;
+        filesReadyTime = now;
+    }
+}
+
+long long Processes::Budget::reserve(bool isBytes, long long amount)
+{
+    long long rate = (isBytes ? bytesPerSecond : filesPerSecond).load(memory_order_relaxed);
+    if (rate <= 0)
+        return 0;
+    atomic<long long> &readyTime = isBytes ? bytesReadyTime : filesReadyTime;
+    long long now = getSteadyTime();
+    long long cost = (long long)(amount * 1000000000.0 / rate);
+    long long previous = readyTime.load(memory_order_relaxed);
+    long long next;
+    do
+        next = max(previous, now) + cost;
+    while (!readyTime.compare_exchange_weak(previous, next, memory_order_relaxed));
+    return next - now - BURST_NS;
 }
-  
-void Directories::removeDIR(DIR **dir)
+
+long long Processes::Budget::getWait(bool isBytes)
 {
-    if (root->next == NULL)
+    long long rate = (isBytes ? bytesPerSecond : filesPerSecond).load(memory_order_relaxed);
+    if (rate <= 0)
+        return 0;
+    long long readyTime = (isBytes ? bytesReadyTime : filesReadyTime).load(memory_order_relaxed);
+    return readyTime - getSteadyTime() - BURST_NS;
+}
+
+void Processes::Progress::reset()
+{
+    directoriesDone = 0;
+    directoriesQueued = 0;
+    filesScanned = 0;
+    bytesScanned = 0;
+    filesPerSecond = 0;
+    bytesPerSecond = 0;
+    pathSequence = 0;
+    currentPath[0] = 0;
+    sampleTime = getSteadyTime();
+    sampleFiles = 0;
+    sampleBytes = 0;
+    lastActivity = sampleTime.load();
+}
+
+// Seqlock, so readers copy a whole path without making search wait on them
+void Processes::Progress::startDirectory(const char *path, int pathLength)
+{
+    unsigned int sequence = pathSequence.load(memory_order_relaxed);
+    pathSequence.store(sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(currentPath, path, pathLength + 1);
+    pathSequence.store(sequence + 2, memory_order_release);
+    updateRate();
+}
+
+void Processes::Progress::finishDirectory()
+{
+    directoriesDone.fetch_add(1, memory_order_relaxed);
+    directoriesQueued.fetch_sub(1, memory_order_relaxed);
+    updateRate();
+}
+
+void Processes::Progress::addFile()
+{
+    filesScanned.fetch_add(1, memory_order_relaxed);
+    updateRate();
+}
+
+void Processes::Progress::addBytes(unsigned long long bytes)
+{
+    bytesScanned.fetch_add(bytes, memory_order_relaxed);
+    updateRate();
+}
+
+void Processes::Progress::updateRate()
+{
+    long long now = getSteadyTime();
+    lastActivity.store(now, memory_order_relaxed);
+    long long previousSample = sampleTime.load(memory_order_relaxed);
+    long long elapsed = now - previousSample;
+    if (elapsed < RATE_INTERVAL_NS || !sampleTime.compare_exchange_strong(previousSample, now, memory_order_relaxed))
+        return;
+    unsigned long long files = filesScanned.load(memory_order_relaxed);
+    unsigned long long bytes = bytesScanned.load(memory_order_relaxed);
+    filesPerSecond.store((files - sampleFiles.load(memory_order_relaxed)) * 1000000000.0 / elapsed, memory_order_relaxed);
+    bytesPerSecond.store((bytes - sampleBytes.load(memory_order_relaxed)) * 1000000000.0 / elapsed, memory_order_relaxed);
+    sampleFiles.store(files, memory_order_relaxed);
+    sampleBytes.store(bytes, memory_order_relaxed);
+}
+
+void Processes::Progress::getCurrentPath(char path[PATHNAME_LENGTH])
+{
+    unsigned int before, after;
+    do
     {
-        if (root->dir == dir)
+        before = pathSequence.load(memory_order_acquire);
+        memcpy(path, currentPath, PATHNAME_LENGTH);
+        atomic_thread_fence(memory_order_acquire);
+        after = pathSequence.load(memory_order_relaxed);
+    } while ((before & 1) != 0 || before != after);
+    path[PATHNAME_LENGTH - 1] = 0;
+}
+
+DirectoryCache::Listing DirectoryCache::getListing(const char *directory, struct stat *sb)
+{
+    if (stat(directory, sb) == -1 || !S_ISDIR(sb->st_mode))
+        return NULL;
+
+    mtx.lock();
+    unordered_map<string, CachedListing>::iterator cached = listings.find(directory);
+    if (cached != listings.end() && cached->second.mtime.tv_sec == sb->st_mtim.tv_sec &&
+        cached->second.mtime.tv_nsec == sb->st_mtim.tv_nsec)
+    {
+        Listing entries = cached->second.entries;
+        mtx.unlock();
+        return entries;
+    }
+    mtx.unlock();
+
+    // Read outside of lock so one slow directory doesn't stall every other client
+    DIR *dir = opendir(directory);
+    if (dir == NULL)
+        return NULL;
+    shared_ptr<vector<Entry>> entries = make_shared<vector<Entry>>();
+    struct dirent *entry;
+    char filePath[PATHNAME_LENGTH];
+    int directoryLength = strlen(directory);
+    memcpy(filePath, directory, directoryLength); // Only entry name is written after this, like DirectoryStack::nextEntry()
+    filePath[directoryLength] = '/';
+    while ((entry = readdir(dir)) != NULL)
+        if (!isPreviousDir(entry->d_name) && !isCurrentDir(entry->d_name))
+        {
+            int nameLength = strlen(entry->d_name);
+            if (directoryLength + 1 + nameLength >= PATHNAME_LENGTH) // Couldn't be opened anyway
+                continue;
+            memcpy(filePath + directoryLength + 1, entry->d_name, nameLength + 1);
+            bool isLink;
+            Entry_Type type = getEntryType(filePath, entry->d_type, &isLink);
+            entries->push_back({ entry->d_name, type, entry->d_ino, isLink });
+        }
+    closedir(dir);
+
+    mtx.lock();
+    if (listings.size() < MAX_DIRECTORIES || listings.count(directory) != 0)
+        listings[directory] = { sb->st_mtim, entries };
+    mtx.unlock();
+    return entries;
+}
+
+DirectoryStack::DirectoryStack()
+{
+    // Pages are only touched as the walk gets deeper
+    frames = (Frame*)mmap(NULL, MAX_DEPTH * sizeof(Frame), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    depth = 0;
+    path[0] = 0;
+    pathLength = 0;
+    followLinks = true;
+}
+
+DirectoryStack::~DirectoryStack()
+{
+    closeAllDIR();
+    munmap(frames, MAX_DEPTH * sizeof(Frame));
+}
+
+void DirectoryStack::setPath(const char *directory)
+{
+    pathLength = strlen(directory);
+    if (pathLength >= PATHNAME_LENGTH)
+        pathLength = PATHNAME_LENGTH - 1;
+    memcpy(path, directory, pathLength);
+    path[pathLength] = 0;
+}
+
+bool DirectoryStack::push()
+{
+    if (depth == MAX_DEPTH)
+        return false;
+    Frame *frame = new (&frames[depth]) Frame();
+    struct stat sb;
+    if (directoryCache != NULL)
+        frame->listing = directoryCache->getListing(path, &sb);
+    else if ((frame->dir = opendir(path)) != NULL && fstat(dirfd(frame->dir), &sb) == -1)
+        sb.st_ino = 0;
+    if (frame->dir == NULL && frame->listing == NULL)
+    {
+        frame->~Frame();
+        return false;
+    }
+    frame->device = sb.st_dev;
+    frame->inode = sb.st_ino;
+    frame->nextEntry = 0;
+    frame->pathLength = pathLength;
+    depth++;
+    return true;
+}
+
+void DirectoryStack::pop()
+{
+    Frame *frame = &frames[--depth];
+    if (frame->dir != NULL)
+        closedir(frame->dir);
+    frame->~Frame();
+    if (depth > 0)
+        endEntry();
+}
+
+bool DirectoryStack::nextEntry(const char **filename, Entry_Type *type)
+{
+    Frame *frame = &frames[depth - 1];
+    while (true)
+    {
+        const char *name;
+        unsigned char dType = DT_UNKNOWN;
+        if (frame->listing != NULL)
         {
-            delete root;
-            root = NULL;
+            if (frame->nextEntry == frame->listing->size())
+                return false;
+            const DirectoryCache::Entry &entry = (*frame->listing)[frame->nextEntry++];
+            name = entry.name.c_str();
+            *type = (entry.isLink && !followLinks) ? ENTRY_OTHER : entry.type;
+            entryInode = entry.inode;
         }
+        else
+        {
+            struct dirent *entry = readdir(frame->dir);
+            if (entry == NULL)
+                return false;
+            if (isPreviousDir(entry->d_name) || isCurrentDir(entry->d_name))
+                continue;
+            name = entry->d_name;
+            dType = entry->d_type;
+            entryInode = entry->d_ino;
+        }
+
+        int nameLength = strlen(name);
+        if (frame->pathLength + 1 + nameLength >= PATHNAME_LENGTH) // Couldn't be opened anyway
+            continue;
+        path[frame->pathLength] = '/';
+        memcpy(path + frame->pathLength + 1, name, nameLength + 1);
+        pathLength = frame->pathLength + 1 + nameLength;
+        if (frame->listing == NULL)
+        {
+            bool isLink = (dType == DT_LNK);
+            if (!isLink || followLinks) // Not following them also saves their stat()
+                *type = getEntryType(path, dType, &isLink);
+            if (isLink && !followLinks)
+                *type = ENTRY_OTHER;
+        }
+        *filename = path + frame->pathLength + 1;
+        return true;
     }
+}
+
+void DirectoryStack::endEntry()
+{
+    pathLength = frames[depth - 1].pathLength;
+    path[pathLength] = 0;
+}
+
+void DirectoryStack::closeAllDIR()
+{
+    while (depth > 0)
+    {
+        Frame *frame = &frames[--depth];
+        if (frame->dir != NULL)
+            closedir(frame->dir);
+        frame->~Frame();
+    }
+}
+
+ReadScheduler::ReadScheduler()
+{
+    count = 0;
+    pathPool = NULL; // Only searches that batch reads pay for pool
+    poolUsed = 0;
+}
+
+ReadScheduler::~ReadScheduler()
+{
+    for (int i = 0; i < count; i++)
+        if (candidates[i].fd != -1)
+            close(candidates[i].fd);
+    delete[] pathPool;
+}
+
+bool ReadScheduler::add(const char *filePath, int pathLength, ino_t inode)
+{
+    if (count == BATCH_SIZE || poolUsed + pathLength + 1 > PATH_POOL_SIZE)
+        return false;
+    if (pathPool == NULL)
+        pathPool = new char[PATH_POOL_SIZE];
+    memcpy(pathPool + poolUsed, filePath, pathLength + 1);
+    candidates[count].pathOffset = poolUsed;
+    candidates[count].fd = -1;
+    candidates[count].inode = inode;
+    candidates[count].physical = 0;
+    candidates[count].prefetched = 0;
+    poolUsed += pathLength + 1;
+    count++;
+    return true;
+}
+
+void ReadScheduler::flush(const Command &command, SearchContext &context)
+{
+    if (isSearchFinished(command, context))
+    {
+        count = 0;
+        poolUsed = 0;
+        return;
+    }
+
+    // Opening only touches metadata, so whole batch is opened up front to find where each file's data lives
+    bool havePhysical = true;
+    for (int i = 0; i < count; i++)
+    {
+        Candidate &candidate = candidates[i];
+        candidate.fd = open(pathPool + candidate.pathOffset, O_RDONLY);
+        if (candidate.fd == -1)
+        {
+            reportOpenError(context, pathPool + candidate.pathOffset);
+            continue;
+        }
+#ifdef FS_IOC_FIEMAP
+        if (havePhysical)
+        {
+            unsigned long long request[(sizeof(struct fiemap) + sizeof(struct fiemap_extent)) / sizeof(unsigned long long)];
+            struct fiemap *map = (struct fiemap*)request;
+            memset(request, 0, sizeof(request));
+            map->fm_length = FIEMAP_MAX_OFFSET;
+            map->fm_extent_count = 1;
+            if (ioctl(candidate.fd, FS_IOC_FIEMAP, map) == -1)
+                havePhysical = false;
+            else if (map->fm_mapped_extents == 1) // Empty files keep 0, they cost no seek
+                candidate.physical = map->fm_extents[0].fe_physical;
+        }
+#else
+        havePhysical = false;
+#endif
+    }
+
+    if (havePhysical)
+        sort(candidates, candidates + count, [](const Candidate &a, const Candidate &b) { return a.physical < b.physical; });
     else
+        sort(candidates, candidates + count, [](const Candidate &a, const Candidate &b) { return a.inode < b.inode; });
+
+    for (int i = 0; i < count && i < READAHEAD_FILES; i++)
+        prefetch(candidates[i], command, context);
+    for (int i = 0; i < count; i++)
     {
-        node *current = root;
-        for (; current->next != NULL; current = current->next)
-            if (current->next->dir == dir)
+        Candidate &candidate = candidates[i];
+        if (!isSearchFinished(command, context)) // Rest of batch is only closed once limit is reached
+        {
+            if (i + READAHEAD_FILES < count)
+                prefetch(candidates[i + READAHEAD_FILES], command, context);
+            if (candidate.fd != -1)
             {
-                node *nextNext = current->next->next;
-                delete current->next;
-                current->next = nextNext;
-                return;
+                context.prepaidBytes = candidate.prefetched;
+                if (isTextInOpenFile(candidate.fd, command.searchText, context))
+                    reportTextMatch(command, context, pathPool + candidate.pathOffset);
+                context.prepaidBytes = 0;
             }
+        }
+        if (candidate.fd != -1)
+        {
+            close(candidate.fd);
+            candidate.fd = -1;
+        }
+    }
+    count = 0;
+    poolUsed = 0;
+}
+
+// Only start of file is prefetched, so a batch of huge files can't flood page cache, and it's paid for like any read
+void ReadScheduler::prefetch(Candidate &candidate, const Command &command, SearchContext &context)
+{
+    struct stat sb;
+    if (candidate.fd == -1 || isSearchFinished(command, context) || fstat(candidate.fd, &sb) == -1)
+        return;
+    candidate.prefetched = min((long long)sb.st_size, (long long)READAHEAD_BYTES);
+    spendBudget(context, true, candidate.prefetched);
+    posix_fadvise(candidate.fd, 0, candidate.prefetched, POSIX_FADV_WILLNEED);
+}
+
+DirectoryQueue::~DirectoryQueue()
+{
+    Chunk *lists[2] = { head, spare };
+    for (Chunk *chunk : lists)
+        while (chunk != NULL)
+        {
+            Chunk *next = chunk->next;
+            delete chunk;
+            chunk = next;
+        }
+}
+
+void DirectoryQueue::push(const char *path, int pathLength, int depth)
+{
+    int entrySize = 2 * sizeof(int) + pathLength + 1;
+    if (tail == NULL || tail->used + entrySize > CHUNK_SIZE)
+    {
+        Chunk *chunk = spare;
+        if (chunk != NULL)
+            spare = chunk->next;
+        else
+            chunk = new Chunk;
+        chunk->next = NULL;
+        chunk->used = 0;
+        chunk->taken = 0;
+        if (tail == NULL)
+            head = chunk;
+        else
+            tail->next = chunk;
+        tail = chunk;
+    }
+    char *entry = tail->data + tail->used;
+    memcpy(entry, &depth, sizeof(int));
+    memcpy(entry + sizeof(int), &pathLength, sizeof(int));
+    memcpy(entry + 2 * sizeof(int), path, pathLength + 1);
+    tail->used += entrySize;
+}
+
+bool DirectoryQueue::pop(const char **path, int *depth)
+{
+    while (head != NULL && head->taken == head->used)
+    {
+        Chunk *finished = head;
+        head = head->next;
+        if (head == NULL)
+            tail = NULL;
+        finished->next = spare;
+        spare = finished;
+    }
+    if (head == NULL)
+        return false;
+
+    char *entry = head->data + head->taken;
+    int pathLength;
+    memcpy(depth, entry, sizeof(int));
+    memcpy(&pathLength, entry + sizeof(int), sizeof(int));
+    *path = entry + 2 * sizeof(int);
+    head->taken += 2 * sizeof(int) + pathLength + 1;
+    return true;
+}
+
+FuzzyMatcher::FuzzyMatcher(const char *pattern, int maxResults)
+{
+    patternLength = min((int)strlen(pattern), (int)MAX_PATTERN_LENGTH);
+    maxDistance = max(1, patternLength / 3);
+    this->maxResults = (maxResults == 0) ? DEFAULT_RESULTS : maxResults;
+    memset(peq, 0, sizeof(peq));
+    for (int i = 0; i < patternLength; i++)
+        peq[(unsigned char)tolower(pattern[i])] |= 1ULL << i;
+    for (int c = 'A'; c <= 'Z'; c++) // Case is ignored, a wrong case is a typo too
+        peq[c] = peq[tolower(c)];
+    patternMask = getCharacterMask(pattern, patternLength);
+}
+
+void FuzzyMatcher::consider(const char *filename, const char *filePath)
+{
+    // Names tying worst kept result still compete on path, so results don't depend on readdir() order
+    int limit = (results.size() == maxResults) ? results.front().distance : maxDistance;
+
+    // Each edit changes length by at most one, and adds or removes at most one kind of character
+    int nameLength = strlen(filename);
+    if (abs(nameLength - patternLength) > limit)
+        return;
+    unsigned long long nameMask = getCharacterMask(filename, nameLength);
+    if (__builtin_popcountll(patternMask & ~nameMask) > limit || __builtin_popcountll(nameMask & ~patternMask) > limit)
+        return;
+
+    int distance = editDistance(filename, nameLength, limit);
+    if (distance > limit)
+        return;
+    if (results.size() == maxResults)
+    {
+        if (distance == results.front().distance && strcmp(filePath, results.front().path.c_str()) >= 0)
+            return;
+        pop_heap(results.begin(), results.end());
+        results.pop_back();
     }
+    results.push_back({ distance, filePath });
+    push_heap(results.begin(), results.end());
+}
+
+void FuzzyMatcher::report(SearchContext &context)
+{
+    if (results.empty())
+        return;
+    sort(results.begin(), results.end());
+    context.foundSomething = true;
+    appendResult(context, "completed.\nClosest files found:\n");
+    for (const Match &match : results)
+    {
+        appendResult(context, to_string(match.distance).c_str());
+        appendResult(context, (match.distance == 1) ? " edit: " : " edits: ");
+        appendResult(context, match.path.c_str());
+        appendResult(context, "\n");
+    }
+    context.resultCount = results.size();
+}
+
+// Global edit distance (Hyyro's form of Myers' algorithm), gives up once result can't get back under limit
+int FuzzyMatcher::editDistance(const char *name, int nameLength, int limit)
+{
+    unsigned long long highBit = 1ULL << (patternLength - 1);
+    unsigned long long pv = (patternLength == 64) ? ~0ULL : (1ULL << patternLength) - 1;
+    unsigned long long mv = 0;
+    int score = patternLength;
+    for (int i = 0; i < nameLength; i++)
+    {
+        unsigned long long eq = peq[(unsigned char)name[i]];
+        unsigned long long xv = eq | mv;
+        unsigned long long xh = (((eq & pv) + pv) ^ pv) | eq;
+        unsigned long long ph = mv | ~(xh | pv);
+        unsigned long long mh = pv & xh;
+        if (ph & highBit)
+            score++;
+        else if (mh & highBit)
+            score--;
+        if (score - (nameLength - i - 1) > limit) // Score drops by at most one per remaining character
+            return score - (nameLength - i - 1);
+        ph = (ph << 1) | 1; // Carry of 1 makes top row 0, 1, 2, ... so whole name has to match, not just part of it
+        mh <<= 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+    }
+    return score;
+}
+
+unsigned long long FuzzyMatcher::getCharacterMask(const char *str, int length)
+{
+    unsigned long long mask = 0;
+    for (int i = 0; i < length; i++)
+        mask |= 1ULL << (tolower((unsigned char)str[i]) & 63);
+    return mask;
 }
 
-void Directories::closeAllDIRAndDestroy()
+VisitedSet::VisitedSet(bool sameFilesystem)
 {
-    node *current = root;
-    while (current != NULL)
+    capacity = INITIAL_CAPACITY;
+    slots = new Slot[capacity]();
+    used = 0;
+    this->sameFilesystem = sameFilesystem;
+}
+
+bool VisitedSet::enterDirectory(dev_t device, ino_t inode, const char *path)
+{
+    if (inode == 0) // Can't be told apart from other directories, so it's walked
+        return true;
+    if (devices.empty())
+        devices.push_back({ device, true });
+    else if (!isDeviceAllowed(device, path))
+        return false;
+    return insert(device, inode, -1);
+}
+
+bool VisitedSet::getFileResult(dev_t device, ino_t inode, bool *found, vector<long long> *locations)
+{
+    Slot *slot = findSlot(device, inode);
+    if (slot->inode == 0 || slot->fileResult == -1)
+        return false;
+    const FileResult &result = fileResults[slot->fileResult];
+    *found = result.found;
+    if (locations != NULL)
+        *locations = result.locations;
+    return true;
+}
+
+void VisitedSet::setFileResult(dev_t device, ino_t inode, bool found, const vector<long long> *locations)
+{
+    fileResults.push_back({ found, (locations != NULL) ? *locations : vector<long long>() });
+    insert(device, inode, fileResults.size() - 1);
+}
+
+VisitedSet::Slot *VisitedSet::findSlot(dev_t device, ino_t inode)
+{
+    // Inode numbers are often sequential, so they're mixed before being used as index
+    unsigned long long hash = ((unsigned long long)inode ^ ((unsigned long long)device << 32 | (unsigned long long)device >> 32)) * 0x9E3779B97F4A7C15ULL;
+    size_t mask = capacity - 1;
+    size_t i = (hash ^ hash >> 29) & mask;
+    while (slots[i].inode != 0 && (slots[i].inode != inode || slots[i].device != device))
+        i = (i + 1) & mask;
+    return &slots[i];
+}
+
+bool VisitedSet::insert(dev_t device, ino_t inode, int fileResult)
+{
+    if (2 * (used + 1) > capacity)
     {
-        node *next = current->next;
-        closedir(*(current->dir));
-        delete current;
-        current = next;
+        Slot *oldSlots = slots;
+        size_t oldCapacity = capacity;
+        capacity *= 2;
+        slots = new Slot[capacity]();
+        for (size_t i = 0; i < oldCapacity; i++)
+            if (oldSlots[i].inode != 0)
+                *findSlot(oldSlots[i].device, oldSlots[i].inode) = oldSlots[i];
+        delete[] oldSlots;
     }
+
+    Slot *slot = findSlot(device, inode);
+    if (slot->inode != 0)
+        return false;
+    *slot = { device, inode, fileResult };
+    used++;
+    return true;
+}
+
+bool VisitedSet::isDeviceAllowed(dev_t device, const char *path)
+{
+    for (const pair<dev_t, bool> &known : devices)
+        if (known.first == device)
+            return known.second;
+
+    // Each new filesystem costs one statfs(), as mount points are only crossed a few times per search
+    bool allowed = !sameFilesystem;
+    struct statfs sb;
+    if (allowed && statfs(path, &sb) == 0)
+        switch (sb.f_type)
+        {
+            case PROC_SUPER_MAGIC: case SYSFS_MAGIC: case DEVPTS_SUPER_MAGIC: case CGROUP_SUPER_MAGIC: case CGROUP2_SUPER_MAGIC:
+            case DEBUGFS_MAGIC: case TRACEFS_MAGIC: case SECURITYFS_MAGIC: case PSTOREFS_MAGIC: case BPF_FS_MAGIC:
+            case SELINUX_MAGIC: case EFIVARFS_MAGIC: case BINFMTFS_MAGIC: case NSFS_MAGIC:
+                allowed = false;
+        }
+    devices.push_back({ device, allowed });
+    return allowed;
 }